@@ -0,0 +1,570 @@
+/**
+ * Load generator for myserver++
+ *
+ * Builds a document root of small, medium and large files, optionally starts the server on it,
+ * then drives it from a number of connections for a while and reports throughput and latency.
+ * Given several I/O backends, it starts the server once with each and reports them side by side
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <iostream>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <vector>
+#include <string>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+//files of each size the document root is filled with
+#define SMALL_FILES 32
+#define MEDIUM_FILES 8
+#define LARGE_FILES 2
+//sizes of the generated files in bytes
+#define SMALL_SIZ 1024
+#define MEDIUM_SIZ (100 << 10)
+#define LARGE_SIZ (8 << 20)
+//percent of requests that go to small and to medium files, the rest go to large ones
+#define SMALL_SHARE 80
+#define MEDIUM_SHARE 18
+//largest response header the generator will read
+#define HEADER_SIZ 8192
+//how long to wait for a spawned server to start listening, in milliseconds
+#define SERVER_WAIT 5000
+//how long a request may go unanswered before it counts as an error, in seconds
+#define REPLY_WAIT 5
+
+/** Bench Options
+ *  Everything the command line can change, with the defaults used when it does not
+ */
+struct BenchOptions {
+  std::string docroot;
+  std::string server;      // path to a server binary to start, empty to use one already running
+  std::string serverArgs;  // extra arguments for the spawned server, split on spaces
+  std::string json;        // file the JSON report goes to, empty for stdout only
+  std::vector<std::string> backends; // -io_backend of each run of the spawned server, none for one run
+  int port;
+  int connections;
+  int duration;            // seconds of measurement
+  int headPercent;         // share of requests that are HEAD instead of GET
+  int keepAlive;           // reuse connections, or open one per request
+
+  BenchOptions(): docroot("/tmp/myserver-bench"),
+		  server(),
+		  serverArgs(),
+		  json(),
+		  backends(),
+		  port(8080),
+		  connections(16),
+		  duration(10),
+		  headPercent(10),
+		  keepAlive(1) {}
+};
+
+/** Worker Result
+ *  What one connection thread measured, latencies in microseconds
+ */
+struct WorkerResult {
+  std::vector<long> latencies;
+  unsigned long long bytes;
+  unsigned long errors;
+
+  WorkerResult(): latencies(), bytes(0), errors(0) {}
+};
+
+/** Bench Report
+ *  The totals of one run, against one backend of the server when several are compared
+ */
+struct BenchReport {
+  std::string backend;     // empty when the server was started without choosing one
+  double elapsed;
+  size_t requests;
+  unsigned long errors;
+  double rps;
+  double mbps;
+  long p50;
+  long p99;
+  long p999;
+  long max;
+  double serverCpu;        // microseconds of server CPU time per request, -1 when it was not spawned
+  long leaked;             // connections the server still counted open after the run, or had lost track of
+
+  BenchReport(): backend(), elapsed(0), requests(0), errors(0), rps(0), mbps(0),
+		 p50(0), p99(0), p999(0), max(0), serverCpu(-1), leaked(0) {}
+};
+
+/**
+ * Method declarations
+ */
+// This method writes the small, medium and large files into the document root
+int generateDocroot(const std::string &docroot);
+
+// This method starts the server on the document root with the given backend, returning its pid or -1
+pid_t startServer(const BenchOptions &opts, const std::string &backend);
+
+// This method starts the server if asked to, drives it for the duration and fills in the report
+int runBench(const BenchOptions &opts, const std::string &backend, BenchReport *report);
+
+// This method waits until something accepts connections on the port
+int waitForServer(int port, int millis);
+
+// This method opens a connection to the server on localhost
+int connectServer(int port);
+
+// This method asks the server how many connections it has open, not counting the one asking
+long openConnections(int port);
+
+// This method sends one request and reads the whole response, returning 0 on success
+int roundTrip(int sock, const char *request, size_t len, int isHEAD, unsigned long long *bytes);
+
+// This method runs one connection until the deadline, recording every request it made
+void benchWorker(const BenchOptions *opts, int id, long long deadline, WorkerResult *result);
+
+// This method returns the latency below which the given fraction of the sorted samples fall
+long percentile(const std::vector<long> &sorted, double fraction);
+
+// This method returns the current time of the monotonic clock in microseconds
+long long nowMicros();
+
+int main(int argc, char** argv)
+{
+  BenchOptions opts;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string current = std::string(argv[i]);
+    if (current.compare("-port") == 0) {
+      opts.port = atoi(argv[i + 1]);
+    } else if (current.compare("-connections") == 0) {
+      opts.connections = atoi(argv[i + 1]);
+    } else if (current.compare("-duration") == 0) {
+      opts.duration = atoi(argv[i + 1]);
+    } else if (current.compare("-head_percent") == 0) {
+      opts.headPercent = atoi(argv[i + 1]);
+    } else if (current.compare("-mode") == 0) {
+      opts.keepAlive = (std::string(argv[i + 1]).compare("close") != 0);
+    } else if (current.compare("-document_root") == 0) {
+      opts.docroot = std::string(argv[i + 1]);
+    } else if (current.compare("-server") == 0) {
+      opts.server = std::string(argv[i + 1]);
+    } else if (current.compare("-server_args") == 0) {
+      opts.serverArgs = std::string(argv[i + 1]);
+    } else if (current.compare("-json") == 0) {
+      opts.json = std::string(argv[i + 1]);
+    } else if (current.compare("-backends") == 0) {
+      std::string list = std::string(argv[i + 1]);
+      size_t pos = 0;
+      while (pos < list.length()) {
+	size_t end = list.find(',', pos);
+	if (end == std::string::npos) end = list.length();
+	if (end > pos) opts.backends.push_back(list.substr(pos, end - pos));
+	pos = end + 1;
+      }
+    } else {
+      std::cout << "Usage is bench [-port <int>] [-connections <int>] [-duration <seconds>]"
+		<< " [-head_percent <0-100>] [-mode keepalive|close] [-document_root <path>]"
+		<< " [-server <path>] [-server_args <string>] [-backends epoll,uring] [-json <path>]\n";
+      return 1;
+    }
+  }
+  if (opts.connections < 1) opts.connections = 1;
+  if (opts.duration < 1) opts.duration = 1;
+  if (!opts.backends.empty() && opts.server.empty()) {
+    std::cout << "Comparing backends needs -server to start the server with each of them\n";
+    return 1;
+  }
+  if (opts.backends.empty()) {
+    opts.backends.push_back("");
+  }
+
+  // a server that closes on us must not kill the generator
+  signal(SIGPIPE, SIG_IGN);
+  if (generateDocroot(opts.docroot) == -1) {
+    std::cout << "Could not write the document root " << opts.docroot << "\n";
+    return 1;
+  }
+  std::vector<BenchReport> reports(opts.backends.size());
+  for (size_t i = 0; i < opts.backends.size(); i++) {
+    if (runBench(opts, opts.backends[i], &reports[i]) == -1) {
+      return 1;
+    }
+  }
+
+  // one column per run, so backends can be compared row by row
+  unsigned long errors = 0;
+  printf("%-14s", "backend");
+  for (size_t i = 0; i < reports.size(); i++) {
+    printf(" %12s", reports[i].backend.empty() ? "-" : reports[i].backend.c_str());
+    errors += reports[i].errors;
+  }
+  printf("\n%-14s", "mode");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12s", opts.keepAlive ? "keepalive" : "close");
+  printf("\n%-14s", "connections");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12d", opts.connections);
+  printf("\n%-14s", "seconds");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12.2f", reports[i].elapsed);
+  printf("\n%-14s", "requests");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12zu", reports[i].requests);
+  printf("\n%-14s", "errors");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12lu", reports[i].errors);
+  printf("\n%-14s", "req/s");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12.1f", reports[i].rps);
+  printf("\n%-14s", "MiB/s");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12.1f", reports[i].mbps);
+  printf("\n%-14s", "p50 us");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12ld", reports[i].p50);
+  printf("\n%-14s", "p99 us");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12ld", reports[i].p99);
+  printf("\n%-14s", "p999 us");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12ld", reports[i].p999);
+  printf("\n%-14s", "max us");
+  for (size_t i = 0; i < reports.size(); i++) printf(" %12ld", reports[i].max);
+  if (reports[0].serverCpu >= 0) {
+    printf("\n%-14s", "server cpu us");
+    for (size_t i = 0; i < reports.size(); i++) printf(" %12.2f", reports[i].serverCpu);
+    printf("\n%-14s", "leaked conns");
+    for (size_t i = 0; i < reports.size(); i++) {
+      printf(" %12ld", reports[i].leaked);
+      if (reports[i].leaked != 0) errors++;
+    }
+  }
+  printf("\n");
+
+  std::string lines;
+  for (size_t i = 0; i < reports.size(); i++) {
+    const BenchReport &r = reports[i];
+    char json[1024];
+    snprintf(json, sizeof(json),
+	     "{\"backend\":\"%s\",\"mode\":\"%s\",\"connections\":%d,\"head_percent\":%d,\"seconds\":%.3f,"
+	     "\"requests\":%zu,\"errors\":%lu,\"rps\":%.1f,\"mib_per_s\":%.2f,"
+	     "\"p50_us\":%ld,\"p99_us\":%ld,\"p999_us\":%ld,\"max_us\":%ld,"
+	     "\"server_cpu_us_per_request\":%.2f,\"leaked_connections\":%ld,\"server_args\":\"%s\"}\n",
+	     r.backend.c_str(), opts.keepAlive ? "keepalive" : "close", opts.connections,
+	     opts.headPercent, r.elapsed, r.requests, r.errors, r.rps, r.mbps, r.p50, r.p99,
+	     r.p999, r.max, r.serverCpu, r.leaked, opts.serverArgs.c_str());
+    lines += json;
+  }
+  printf("%s", lines.c_str());
+  if (!opts.json.empty()) {
+    FILE *out = fopen(opts.json.c_str(), "w");
+    if (out != NULL) {
+      fputs(lines.c_str(), out);
+      fclose(out);
+    }
+  }
+  return (errors == 0) ? 0 : 2;
+}
+
+int runBench(const BenchOptions &opts, const std::string &backend, BenchReport *report)
+{
+  report->backend = backend;
+  pid_t server = -1;
+  if (!opts.server.empty()) {
+    server = startServer(opts, backend);
+    if (server == -1) {
+      std::cout << "Could not start " << opts.server << "\n";
+      return -1;
+    }
+  }
+  if (waitForServer(opts.port, SERVER_WAIT) == -1) {
+    std::cout << "Nothing is listening on port " << opts.port << "\n";
+    if (server != -1) kill(server, SIGTERM);
+    return -1;
+  }
+
+  std::vector<WorkerResult> results(opts.connections);
+  std::vector<std::thread> workers;
+  long long started = nowMicros();
+  long long deadline = started + (long long)opts.duration * 1000000;
+  for (int i = 0; i < opts.connections; i++) {
+    workers.push_back(std::thread(benchWorker, &opts, i, deadline, &results[i]));
+  }
+  for (int i = 0; i < opts.connections; i++) {
+    workers[i].join();
+  }
+  report->elapsed = (nowMicros() - started) / 1e6;
+  if (server != -1) {
+    // every connection of the run is closed by now, once the server has noticed it should count
+    // none, a count that stays above zero or went below it means connections were mishandled
+    for (int waited = 0; waited < SERVER_WAIT; waited += 50) {
+      report->leaked = openConnections(opts.port);
+      if (report->leaked == 0) break;
+      usleep(50000);
+    }
+  }
+
+  std::vector<long> all;
+  unsigned long long bytes = 0;
+  for (int i = 0; i < opts.connections; i++) {
+    all.insert(all.end(), results[i].latencies.begin(), results[i].latencies.end());
+    bytes += results[i].bytes;
+    report->errors += results[i].errors;
+  }
+  std::sort(all.begin(), all.end());
+  report->requests = all.size();
+  report->rps = all.size() / report->elapsed;
+  report->mbps = bytes / report->elapsed / (1 << 20);
+  report->p50 = percentile(all, 0.50);
+  report->p99 = percentile(all, 0.99);
+  report->p999 = percentile(all, 0.999);
+  report->max = all.empty() ? 0 : all.back();
+  if (server != -1) {
+    // the CPU the server spent, user and system, is what the backends differ in most
+    struct rusage usage;
+    kill(server, SIGTERM);
+    if (wait4(server, NULL, 0, &usage) == server && !all.empty()) {
+      double cpu = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6
+	+ usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+      report->serverCpu = cpu / all.size();
+    }
+    // an io_uring can hold the listener a moment past the server's exit, and with SO_REUSEPORT the
+    // next run's connections would land on it
+    for (int waited = 0; waited < SERVER_WAIT; waited += 50) {
+      int sock = connectServer(opts.port);
+      if (sock == -1) break;
+      close(sock);
+      usleep(50000);
+    }
+  }
+  return 0;
+}
+
+// writes a file of the given size unless one of that size is already there
+static int writeFile(const std::string &path, size_t size)
+{
+  struct stat s;
+  if ((stat(path.c_str(), &s) == 0) && ((size_t)s.st_size == size)) {
+    return 0;
+  }
+  FILE *out = fopen(path.c_str(), "w");
+  if (out == NULL) return -1;
+  // readable text, so that compression behaves the way it would on real pages
+  static const char line[] = "the quick brown fox jumps over the lazy dog 0123456789\n";
+  for (size_t done = 0; done < size; done += sizeof(line) - 1) {
+    size_t len = (size - done < sizeof(line) - 1) ? size - done : sizeof(line) - 1;
+    fwrite(line, 1, len, out);
+  }
+  fclose(out);
+  return 0;
+}
+
+int generateDocroot(const std::string &docroot)
+{
+  mkdir(docroot.c_str(), 0755);
+  char name[64];
+  for (int i = 0; i < SMALL_FILES; i++) {
+    snprintf(name, sizeof(name), "/small%d.html", i);
+    if (writeFile(docroot + name, SMALL_SIZ) == -1) return -1;
+  }
+  for (int i = 0; i < MEDIUM_FILES; i++) {
+    snprintf(name, sizeof(name), "/medium%d.js", i);
+    if (writeFile(docroot + name, MEDIUM_SIZ) == -1) return -1;
+  }
+  for (int i = 0; i < LARGE_FILES; i++) {
+    snprintf(name, sizeof(name), "/large%d.jpg", i);
+    if (writeFile(docroot + name, LARGE_SIZ) == -1) return -1;
+  }
+  return 0;
+}
+
+pid_t startServer(const BenchOptions &opts, const std::string &backend)
+{
+  std::vector<std::string> args;
+  args.push_back(opts.server);
+  args.push_back("-document_root");
+  args.push_back(opts.docroot);
+  args.push_back("-port");
+  args.push_back(std::to_string(opts.port));
+  size_t pos = 0;
+  while (pos < opts.serverArgs.length()) {
+    size_t end = opts.serverArgs.find(' ', pos);
+    if (end == std::string::npos) end = opts.serverArgs.length();
+    if (end > pos) args.push_back(opts.serverArgs.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  if (!backend.empty()) {
+    args.push_back("-io_backend");
+    args.push_back(backend);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::vector<char*> argv;
+    for (size_t i = 0; i < args.size(); i++) argv.push_back((char*)args[i].c_str());
+    argv.push_back(NULL);
+    // the server's own logging would only get in the way of the report
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull != -1) dup2(devnull, STDOUT_FILENO);
+    execv(argv[0], &argv[0]);
+    _exit(127);
+  }
+  return pid;
+}
+
+int waitForServer(int port, int millis)
+{
+  for (int waited = 0; waited < millis; waited += 50) {
+    int sock = connectServer(port);
+    if (sock != -1) {
+      close(sock);
+      return 0;
+    }
+    usleep(50000);
+  }
+  return -1;
+}
+
+int connectServer(int port)
+{
+  int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock == -1) return -1;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(sock);
+    return -1;
+  }
+  int uno = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+  // a request the server lost is an error, not a generator stuck for good
+  struct timeval wait;
+  wait.tv_sec = REPLY_WAIT;
+  wait.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+  return sock;
+}
+
+long openConnections(int port)
+{
+  int sock = connectServer(port);
+  if (sock == -1) return -1;
+  static const char request[] = "GET /__stats HTTP/1.0\r\n\r\n";
+  std::string reply;
+  if (send(sock, request, sizeof(request) - 1, 0) == (ssize_t)(sizeof(request) - 1)) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) reply.append(buf, n);
+  }
+  close(sock);
+  size_t field = reply.find("\nconnections_open ");
+  if (field == std::string::npos) return -1;
+  return atol(reply.c_str() + field + 18) - 1;
+}
+
+int roundTrip(int sock, const char *request, size_t len, int isHEAD, unsigned long long *bytes)
+{
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t wrote = send(sock, request + sent, len - sent, 0);
+    if (wrote == -1 && errno == EINTR) continue;
+    if (wrote <= 0) return -1;
+    sent += wrote;
+  }
+  // the header is read up to its blank line, and whatever of the body came with it is counted
+  char buf[HEADER_SIZ];
+  size_t got = 0;
+  char *end = NULL;
+  while (end == NULL) {
+    if (got == sizeof(buf)) return -1;
+    ssize_t n = recv(sock, buf + got, sizeof(buf) - got, 0);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    got += n;
+    end = (char*)memmem(buf, got, "\r\n\r\n", 4);
+  }
+  if (got < 12 || (strncmp(buf + 9, "200", 3) != 0 && strncmp(buf + 9, "304", 3) != 0)) {
+    return -1;
+  }
+  size_t headerLen = end + 4 - buf;
+  long long length = 0;
+  char *field = (char*)memmem(buf, headerLen, "Content-Length:", 15);
+  if (field != NULL) {
+    length = atoll(field + 15);
+  }
+  if (isHEAD) {
+    length = 0;
+  }
+  long long body = got - headerLen;
+  char sink[65536];
+  while (body < length) {
+    long long want = length - body;
+    ssize_t n = recv(sock, sink, (want < (long long)sizeof(sink)) ? want : sizeof(sink), 0);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    body += n;
+  }
+  *bytes += headerLen + body;
+  return 0;
+}
+
+void benchWorker(const BenchOptions *opts, int id, long long deadline, WorkerResult *result)
+{
+  // every connection follows its own reproducible sequence of files and methods
+  unsigned int seed = 12345 + id;
+  int sock = -1;
+  char request[256];
+  while (nowMicros() < deadline) {
+    int pick = rand_r(&seed) % 100;
+    char name[64];
+    if (pick < SMALL_SHARE) {
+      snprintf(name, sizeof(name), "/small%d.html", rand_r(&seed) % SMALL_FILES);
+    } else if (pick < SMALL_SHARE + MEDIUM_SHARE) {
+      snprintf(name, sizeof(name), "/medium%d.js", rand_r(&seed) % MEDIUM_FILES);
+    } else {
+      snprintf(name, sizeof(name), "/large%d.jpg", rand_r(&seed) % LARGE_FILES);
+    }
+    int isHEAD = (rand_r(&seed) % 100) < opts->headPercent;
+    // HTTP/1.0 is how a client asks this server to close after the response
+    int len = snprintf(request, sizeof(request), "%s %s HTTP/1.%d\r\nHost: localhost\r\n\r\n",
+		       isHEAD ? "HEAD" : "GET", name, opts->keepAlive ? 1 : 0);
+
+    long long started = nowMicros();
+    if (sock == -1) {
+      sock = connectServer(opts->port);
+      if (sock == -1) {
+	result->errors++;
+	usleep(1000);
+	continue;
+      }
+    }
+    if (roundTrip(sock, request, len, isHEAD, &result->bytes) == -1) {
+      result->errors++;
+      close(sock);
+      sock = -1;
+      continue;
+    }
+    result->latencies.push_back(nowMicros() - started);
+    if (!opts->keepAlive) {
+      close(sock);
+      sock = -1;
+    }
+  }
+  if (sock != -1) close(sock);
+}
+
+long percentile(const std::vector<long> &sorted, double fraction)
+{
+  if (sorted.empty()) return 0;
+  size_t index = (size_t)(fraction * sorted.size());
+  if (index >= sorted.size()) index = sorted.size() - 1;
+  return sorted[index];
+}
+
+long long nowMicros()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
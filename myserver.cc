@@ -10,23 +10,164 @@
 #include <fstream>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <list>
+#include <memory>
+#include <unordered_map>
 #include <string.h>
 #include <string>
 #include <time.h>
 #include <sys/stat.h>
-#include <regex>
 #include <thread>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <zlib.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
 #include <poll.h>
 
-//number of clients that can be in the backlog
-#define MAX_BACKLOG 10
-//size of the buffer for requests
+//default number of clients that can wait in the kernel's backlog, the kernel may cap it lower
+#define MAX_BACKLOG 1024
+//default number of open connections, across all workers, at which the server is overloaded
+#define MAX_CONNECTIONS 10000
+//default number of requests a worker has read but not finished answering at which it stops admitting new connections
+#define QUEUE_CAP 1024
+//default number of connections accepted per reactor wakeup, so a flood cannot starve the others
+#define ACCEPT_BATCH 64
+//what an overloaded worker does with connections it cannot shed idle ones for
+#define OVERLOAD_REJECT 0
+#define OVERLOAD_PAUSE 1
+//the I/O engines a worker can run its sockets on
+#define IO_EPOLL 0
+#define IO_URING 1
+//submission queue entries of each worker's io_uring
+#define URING_ENTRIES 1024
+//receive buffers each worker lends its io_uring, a power of two, and the size of each
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZ 4096
+//buffer group the receive buffers are registered under
+#define URING_BGID 1
+//largest piece of a file read and sent by one linked pair of operations
+#define URING_CHUNK_SIZ (256 << 10)
+//what an io_uring completion belongs to, kept in the low bits of its user_data
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_FILE_READ 3
+#define OP_FILE_SEND 4
+#define OP_CANCEL 5
+#define OP_WAKE 6
+#define OP_MASK 7
+//size of the buffer for requests, the smallest block handed out by the buffer pool
 #define REQ_SIZ 2048
-//size of each packet sent to the client
-#define PACK_SIZ 1450
+//largest request header accepted, the biggest block the buffer pool hands out
+#define MAX_REQ_SIZ (REQ_SIZ << 4)
+//number of blocks carved out of every slab the buffer pool allocates
+#define SLAB_BLOCKS 32
+//spare Requests and Connections each worker keeps for reuse, anything beyond goes back to the heap
+#define POOL_KEEP 1024
+//most bytes one response may send before letting the other connections of its worker have a turn
+#define SEND_BUDGET (16 << 20)
 //default timeout of the HTTP 1.1 connections
 #define TIMEOUT 20000
+//shortest timeout connections are cut down to when the server is busy
+#define MIN_TIMEOUT 2000
+//open connections at which the timeout has shrunk all the way to MIN_TIMEOUT
+#define BUSY_CONNECTIONS 10000
+//resident memory at which the timeout has shrunk all the way to MIN_TIMEOUT
+#define BUSY_MEMORY (1024L << 20)
+//seconds covered by the timer wheel, longer than the longest timeout
+#define WHEEL_SLOTS 64
+//number of events taken from the reactor per wakeup
+#define MAX_EVENTS 64
+//how often, in milliseconds, a worker turns its timer wheel
+#define TICK_INTERVAL 1000
+//most bytes of file contents each worker's hot-file cache may hold
+#define CACHE_SIZ (64 << 20)
+//largest file that is kept in the hot-file cache
+#define CACHE_FILE_SIZ (1 << 20)
+//URIs each worker remembers the resolution of
+#define PATH_CACHE_SIZ 4096
+//seconds a file found under the document root is trusted before it is looked up again
+#define PATH_TTL 1
+//seconds a missing or forbidden path is remembered, so probes for it never reach the filesystem
+#define MISSING_TTL 2
+//default number of porters, the threads that do the filesystem work that may block on the disk
+#define BLOCKING_THREADS 4
+//most bytes of a file a porter reads into the page cache for one job
+#define WARM_SIZ (1 << 20)
+//what a porter is asked to do, look up the path of a request, read ahead of sendfile or compress a body
+#define JOB_RESOLVE 0
+#define JOB_READ 1
+#define JOB_ENCODE 2
+//open descriptors of large files each worker keeps for requests to share
+#define FD_CACHE_SIZ 256
+//seconds a shared descriptor nobody is sending from stays open
+#define FD_IDLE 10
+//what is loaded from the document root at startup, nothing, an index of its files, or their contents too
+#define PRELOAD_OFF 0
+#define PRELOAD_INDEX 1
+#define PRELOAD_CONTENTS 2
+//most bytes of file contents the preload arena holds, files past it are only indexed
+#define PRELOAD_SIZ (128 << 20)
+//most header lines remembered for a single request
+#define MAX_HEADERS 32
+//most pieces of queued responses handed to a single writev
+#define MAX_IOV 64
+//records each thread can have waiting for the log writer, a power of two
+#define LOG_RING_SIZ 4096
+//size of one log record, longer messages are cut short
+#define LOG_RECORD_SIZ 256
+//how long, in microseconds, the log writer sleeps when every ring is empty
+#define LOG_IDLE 10000
+//the reserved URI the server answers with its own statistics
+#define STATS_URI "/__stats"
+//precision of the latency histograms, each power of two is split into 1 << HIST_SUB_BITS buckets
+#define HIST_SUB_BITS 4
+//powers of two the latency histograms reach, in nanoseconds, which is about half an hour
+#define HIST_MAGNITUDES 41
+#define HIST_BUCKETS ((HIST_MAGNITUDES - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+//methods counted separately by the statistics, one per METHOD_ code
+#define METHODS 4
+//status codes counted separately by the statistics, anything else is counted as other
+#define STATUS_SLOTS 10
+
+//log levels, a message is written when its level is at or below the chosen one
+#define LOG_OFF 0
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+//methods the server knows, classified once when a request is parsed
+#define METHOD_OTHER 0
+#define METHOD_GET 1
+#define METHOD_HEAD 2
+#define METHOD_OPTIONS 3
+//content codings a body can be sent in, and the number of them
+#define ENCODING_IDENTITY 0
+#define ENCODING_GZIP 1
+#define ENCODING_DEFLATE 2
+#define ENCODINGS 3
+//room reserved for the fixed lines of a response header, the status, type and extra lines come on top
+#define MAX_HEADER_SIZ 1024
 
 class MyServer
 {
@@ -34,15 +175,143 @@ class MyServer
 };
 
 std::string rootDirectory;
-std::queue<struct Request*> eventQueue;
-int connectionsOpen; // the number of currently open connections
+int rootFd = -1; // an O_PATH descriptor on the document root, every file is resolved beneath it
+std::atomic<int> connectionsOpen(0); // the number of currently open connections, across all workers
+int logLevel = LOG_ERROR;
+int accessLogFd = -1;    // where access records go, -1 when there is no access log
+int accessLogBinary = 0; // access records are written as packed AccessRecords instead of text
+int listenBacklog = MAX_BACKLOG;
+int maxConnections = MAX_CONNECTIONS;
+size_t queueCap = QUEUE_CAP;
+int acceptBatch = ACCEPT_BATCH;
+int overloadPolicy = OVERLOAD_REJECT;
+int ioBackend = IO_EPOLL;
+int preloadMode = PRELOAD_OFF;
+int blockingThreads = BLOCKING_THREADS;
+// each worker thread runs its own reactor with its own queue, nothing here is shared between them
+thread_local std::queue<struct Connection*> eventQueue;
+thread_local int epollFd; // the reactor that owns this worker's listening socket and client sockets
+// every open connection of this worker, indexed by socket
+thread_local std::vector<struct Connection*> connectionTable;
+// the Date line of every response, rendered once a second by the worker's reactor loop
+thread_local char dateLine[64];
+thread_local size_t dateLineLen;
+thread_local int acceptPending; // the listener may still hold connections this worker has not taken
+// what a rejected client is told before it is hung up on
+static const char overloadResponse[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"
+  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+// the Server line never changes, so it is rendered once for the whole process
+static const char serverLine[] = "Server: Creation of Aaron M. Taylor and Devin P. Gardella for cs339 at Williams College\r\n";
 
 /**
  * Method declarations
  */
-// This method continually listens for incoming connections and calls methods to handle them
+// This method runs the reactor loop, waiting on every socket the server owns
 int mainListener(int port);
 
+// This method accepts up to a batch of pending connections, applying the overload policy
+int acceptConnections(int mainSock);
+
+// This method takes an accepted socket on as a new connection of this worker
+void openConnection(int newSock);
+
+// This method turns an accepted socket away with a 503
+void rejectConnection(int newSock);
+
+// This method runs the reactor loop on io_uring instead of epoll, returning -1 if it cannot be set up
+int uringListener(int mainSock);
+
+// This method handles one io_uring completion
+void uringCompletion(struct io_uring_cqe *cqe, int mainSock);
+
+// This method arms a multishot receive on a connection
+void uringArmRecv(struct Connection *conn);
+
+// This method moves what a connection received into its buffer and answers it, unless it is sending
+void uringServe(struct Connection *conn);
+
+// This method submits the send of a connection's queued responses, or the next piece of its file
+int uringFlush(struct Connection *conn);
+
+// This method reports whether the server is at its connection limit or this worker at its queue cap
+int isOverloaded();
+
+// This method closes the connection of this worker that has been idle the longest, returning 0 if none is
+int shedIdleConnection();
+
+// This method reacts to the reactor reporting activity on a client connection
+void connectionEvent(struct Connection *conn, uint32_t events);
+
+// This method reads whatever the client has sent into the connection's buffer
+int readConnection(struct Connection *conn);
+
+// This method answers every complete request received on a connection and writes out the responses
+void serveConnection(struct Connection *conn);
+
+// This method writes the queued responses of a connection with as few system calls as possible
+int flushConnection(struct Connection *conn);
+
+// This method streams the body of a response from its file
+int sendFile(struct Request *curReq);
+
+// This method registers a client connection with the given reactor
+int watchConnection(int reactor, struct Connection *conn);
+
+
+// This method releases a request once its response is queued, marking the connection to close if needed
+void finishRequest(struct Request *curReq);
+
+// This method closes a connection and releases it
+void closeConnection(struct Connection *conn);
+
+// This method closes the socket of a connection nothing refers to anymore and returns it to the pool
+void releaseConnection(struct Connection *conn);
+
+// This method drops the pieces of a connection's queued output that the given bytes have written
+void advanceOutput(struct Connection *conn, size_t sent);
+
+// This method returns the send flags that hold back the last queued piece when a file follows it
+int moreFlag(struct Connection *conn, size_t last);
+
+// This method makes room for len more bytes in outstr without freeing what a send in flight reads
+void reserveOutput(struct Connection *conn, size_t len);
+
+// This method queues bytes to be written on a connection after everything queued before them
+void queueOutput(struct Connection *conn, const char *bytes, size_t len);
+
+// This method queues the body of a cached file to be written on a connection
+void queueBody(struct Connection *conn, std::shared_ptr<struct CachedFile> body, off_t start, off_t len);
+
+// This method puts a socket into non-blocking mode
+int setNonBlocking(int sock);
+
+// This method queues a printf style message for the log writer if its level is enabled
+void logMessage(int level, const char *format, ...);
+
+// This method writes an error straight to stderr and exits, for failures the server cannot go on after
+void logFatal(const char *format, ...);
+
+// This method queues the access record of an answered request for the log writer
+void logAccess(struct Request *curReq);
+
+// This method runs the background log writer, draining every thread's ring
+void logWriter();
+
+// This method returns a monotonic time in microseconds
+long long nowMicros();
+
+// This method returns a monotonic time in nanoseconds
+long long nowNanos();
+
+// This method creates the statistics of the calling worker and makes them visible to the others
+void registerStats();
+
+// This method renders the statistics of every worker, as text or in the Prometheus format
+std::string renderStats(int prometheus);
+
+// This method answers the reserved statistics URI
+int respondToStats(struct Request *curReq);
+
 // This method handles all requests, either responding with error codes or servicing client requests
 void handleRequest(struct Request *curReq);
 
@@ -52,555 +321,4542 @@ int respondToHEAD(struct Request *curReq);
 
 int respondToOPTIONS(struct Request *curReq);
 
+// This method answers a GET or HEAD for a file that was found, settling its range and encoding first
+void respondToFile(struct Request *curReq);
+
+// This method sends the negotiated body of the current request, or only its header for a HEAD
+void respondWithBody(struct Request *curReq);
+
+// This method answers a conditional request whose validators still match with 304 Not Modified
+void respondNotModified(struct Request *curReq);
+
+// This method reports whether the client's If-None-Match or If-Modified-Since says it is up to date
+int isNotModified(struct Request *curReq);
+
+// This method narrows the body to the client's Range, returning 1 for a range, 0 for the whole file
+// and -1 for a range that lies outside it
+int selectRange(struct Request *curReq);
+
 // This method responds to unsupported or disallowed client requests with the appropriate error
 int respondWithError(struct Request *curReq, std::string error);
 
-// This method returns the header string for the current request
-std::string getHeader(struct Request *curReq, std::string status);
+// This method writes the header for the current request into buf, returning its length, or 0 if it does not fit
+size_t buildHeader(struct Request *curReq, const char *status, const char *type,
+		   const char *extra, size_t extralen, char *buf, size_t cap);
+
+// This method builds the header for the current request straight into its connection's output,
+// returning -1 if it could not be built and a bare 500 that ends the connection was queued instead
+int queueHeader(struct Request *curReq, const char *status, const char *type,
+		const char *extra, size_t extralen);
+
+// This method renders the Date line for the given second
+void refreshDate(time_t now);
+
+// This method returns the content type for the last extension of filename, or "" if it is unknown
+const char *contentTypeForFile(const std::string &filename);
+
+// This method reports whether a body of the given content type is worth compressing
+int isCompressible(const char *type);
+
+// This method returns a bit, 1 << ENCODING_, for every content coding the client accepts
+int acceptedEncodings(struct Request *curReq);
+
+// This method swaps the body of the current request for a compressed one when the client takes it,
+// returning 1 if the porters were asked to make or open that body first
+int negotiateEncoding(struct Request *curReq);
+
+// This method returns the encoding a 200 for the current request would be sent in, so a 304 can match it
+int expectedEncoding(struct Request *curReq);
+
+// This method builds the content type table, adding the types listed in a mime.types style file
+int loadMimeTypes(const char *path);
+
+// This method advances the request parser over whatever has arrived in the buffer
+int parseRequest(struct RequestParser *parser, const char *buf, size_t len);
+
+// This method finds the value of a header by case-insensitive name, returning 0 if it is absent
+int findHeader(struct RequestParser *parser, const char *buf, const char *name, struct Slice *value);
+
+// This method finds the length of the body of a parsed request, returning 0 if it cannot be told
+int bodyLength(struct RequestParser *parser, const char *buf, unsigned long long *len);
+
+// This method compares a slice of the buffer against a string without regard to case
+int sliceEquals(const char *buf, struct Slice slice, const char *str);
+
+// This method turns a URI into a path relative to the document root, returning -1 if it cannot be one
+int uriToPath(const std::string &uri, std::string *path);
+
+// This method opens a relative path without letting .., symlinks or anything else lead outside the root
+int openBeneath(const char *path, int flags);
+
+// This method returns the status line for a status that path resolution can end in
+const char *resolveStatus(int status);
+
+// This method looks the file behind path up beneath the root, without any cache, from any thread
+int lookupPath(const std::string &path, struct stat *s, int *file);
+
+// This method hands the lookup of a request's path to the porters, returning 0 if it is done inline
+int deferRequest(struct Request *curReq);
+
+// This method hands reading the next piece of a file being sent to the porters
+void deferRead(struct Request *curReq, off_t len);
+
+// This method hands making the body of a request in encoding to the porters, returning 0 if it is done inline
+int deferEncode(struct Request *curReq, int encoding);
+
+// This method takes back the jobs the porters finished for this worker and resumes their connections
+void collectJobs();
+
+// This method opens the file of a request, sharing the descriptor of a large file with other requests
+int openFile(struct Request *curReq, struct stat *s);
+
+// This method lets go of the file of a request, closing it unless it is shared
+void releaseFile(struct Request *curReq);
+
+// This method answers a GET or HEAD from the preload index, returning 0 if the file is to be read from disk
+int respondFromIndex(struct Request *curReq);
+
+// This method swaps in the newest preload index if the worker is not using it yet
+void refreshIndex();
+
+// This method runs the librarian, which rebuilds the preload index whenever the server gets a SIGHUP
+void indexRebuilder();
+
+// This method writes n in decimal at buf, returning the number of digits
+size_t formatNumber(char *buf, unsigned long long n);
+
+// This method writes the ETag of a file with the given mtime and size at buf, returning its length
+size_t formatETag(char *buf, time_t mtime, off_t size, int weak);
+
+// This method writes the ETag, Last-Modified and Accept-Ranges lines of a file into buf
+size_t formatValidators(char *buf, size_t cap, time_t mtime, off_t size, int weak);
+
+// This method reads an HTTP-date, returning -1 if it is not one
+time_t parseHttpDate(const char *date, size_t len);
+
+// This method uses a simple herustic to return a variable timeout for a connection
+int getTimeout();
+
+// This method returns the resident memory of the server in bytes
+long residentMemory();
+
+// This method will cycle once through the requests waiting in the event queue
+int eventProcessor();
+
+//Decides whether to keep the connection open for further requests once this one is answered
+int doesListenMore(Request *curReq);
+
+
+/** Request Parser
+ *  An incremental state machine over the receive buffer. It is resumed after every recv with the
+ *  same (grown) buffer and picks up at pos, so each byte is looked at once. It never copies or
+ *  allocates: the request line and headers are recorded as slices of the buffer, kept as offsets
+ *  so they stay valid if the buffer is reallocated as it grows
+ */
+
+struct Slice {
+  size_t start;
+  size_t len;
+};
+
+enum ParseState { P_METHOD, P_URI, P_VERSION, P_TRAIL, P_LF, P_LINE, P_NAME,
+		  P_VALUE_START, P_VALUE, P_FINAL_LF, P_DONE, P_ERROR };
+
+//parseRequest results
+#define PARSE_ERROR -1
+#define PARSE_INCOMPLETE 0
+#define PARSE_DONE 1
+
+struct RequestParser {
+  int state;
+  size_t pos;      // the next byte of the buffer to look at, the end of the header once done
+  size_t mark;     // where the token currently being read began
+  size_t valueEnd; // one past the last non-blank byte of the header value being read
+  Slice method;
+  Slice uri;
+  Slice version;
+  Slice names[MAX_HEADERS];
+  Slice values[MAX_HEADERS];
+  int headers;
+  int dropped;     // headers past MAX_HEADERS, whose names were never looked at
+
+  RequestParser():state(P_METHOD), pos(0), mark(0), valueEnd(0), headers(0), dropped(0) {}
+  // starts over on a new request beginning at start
+  void restart(size_t start) { *this = RequestParser(); pos = start; mark = start; }
+};
+
+/** Read Buffer
+ *  The bytes received on a connection. Its block comes from the worker's BufferPool and it
+ *  belongs to the connection, so bytes the client pipelined carry over to the next request
+ */
+
+struct ReadBuffer {
+  char *data;
+  size_t len; // bytes received so far
+  size_t cap; // size of the block
+};
+
+/** Buffer Pool
+ *  Hands out read buffer blocks in power of two size classes from REQ_SIZ up to MAX_REQ_SIZ.
+ *  Blocks are carved from slabs and recycled through per-class free lists, so once a worker is
+ *  warm no request touches the heap for its buffer. Every worker owns one, so it needs no locking
+ */
+class BufferPool
+{
+public:
+  // gives buf an empty block of at least size bytes
+  void acquire(struct ReadBuffer *buf, size_t size);
+  // moves buf into the next size class up, keeping its contents; returns 0 if it is at the largest
+  int grow(struct ReadBuffer *buf);
+  // returns the block of buf to its free list
+  void release(struct ReadBuffer *buf);
+
+private:
+  static const int CLASSES = 5; // REQ_SIZ << 0 through MAX_REQ_SIZ
+  std::vector<char*> freeBlocks[CLASSES];
+};
+
+thread_local BufferPool bufferPool;
+
+/** Output Piece
+ *  One stretch of a queued response: either bytes in the connection's outstr, or part of the body
+ *  of a cached file, which the piece keeps alive until it has been written
+ */
+
+struct OutPiece {
+  std::shared_ptr<struct CachedFile> body; // NULL when the bytes live in outstr
+  size_t start;
+  size_t len;
+};
+
+/** Parked Buffer
+ *  Part of an io_uring receive buffer holding bytes the connection's inbuf had no room for yet
+ */
+
+struct ParkedBuffer {
+  int bid;
+  size_t start;
+  size_t len;
+};
+
+/** Connection Structure
+ *  The state of a client socket that outlives the requests sent on it. Requests are answered in
+ *  the order they arrive and their responses are queued here, so everything the client pipelined
+ *  can go back out in a single sendmsg. At most one response streams its body from a file, and
+ *  requests behind it wait until it has been sent
+ */
+
+struct Connection {
+  int socket;
+  ReadBuffer inbuf;
+  size_t consumed;         // bytes of inbuf that belong to requests already answered
+  unsigned long long skip; // bytes of the last request's body that are still to come, and are thrown away
+  RequestParser parser;    // reads the next request, starting at consumed
+  std::string outstr;      // the bytes of queued headers and small bodies
+  std::vector<OutPiece> out;
+  size_t outHead;          // the first piece of out not yet written completely
+  struct Request *sending; // the response whose file goes out once everything in out is written
+  int readable; // the socket may hold bytes that have not been read yet
+  int parked;   // the responses are waiting for the socket to become writable
+  int queued;   // waiting in the event queue, the reactor leaves it alone
+  int closing;  // the last response has been queued, the connection closes once it is written
+  int eof;      // the client has stopped sending
+  int idle;     // everything was answered and the connection waits for the client to speak again
+  struct Connection *idlePrev; // neighbours in the worker's idle list, oldest first
+  struct Connection *idleNext;
+  time_t lastActive; // the last time anything was read from or written to the socket
+  struct Connection *wheelPrev; // neighbours in the timer wheel slot
+  struct Connection *wheelNext;
+  int wheelSlot;                // -1 when not in the timer wheel
+  struct BlockingJob *job; // filesystem work the porters are doing for it, nothing is served until it is back
+  // only the io_uring backend uses the rest
+  int inflight;     // submitted operations, and handlers running, that still refer to the connection
+  int dead;         // closed, the last of inflight to finish gives it back to the pool
+  int sendInFlight; // a send of out or of a piece of the file has not completed yet
+  std::deque<ParkedBuffer> parkedBufs; // what was received but did not fit in inbuf yet
+  struct msghdr msg;                   // what the send of out in flight is writing
+  std::vector<std::string> retired;    // earlier outstr buffers that send may still be reading
+  struct iovec iov[MAX_IOV];
+  char *chunk;      // the piece of the file being sent
+  size_t chunkLen;
+  size_t chunkSent;
+  ssize_t chunkRead; // what the read of the piece returned, -1 until it completes
+
+  Connection():socket(-1),
+	       inbuf(),
+	       consumed(0),
+	       skip(0),
+	       parser(),
+	       outstr(),
+	       out(),
+	       outHead(0),
+	       sending(NULL),
+	       readable(1),
+	       parked(0),
+	       queued(0),
+	       closing(0),
+	       eof(0),
+	       idle(0),
+	       idlePrev(NULL),
+	       idleNext(NULL),
+	       lastActive(0),
+	       wheelPrev(NULL),
+	       wheelNext(NULL),
+	       wheelSlot(-1),
+	       job(NULL),
+	       inflight(0),
+	       dead(0),
+	       sendInFlight(0),
+	       parkedBufs(),
+	       chunk(NULL),
+	       chunkLen(0),
+	       chunkSent(0),
+	       chunkRead(-1) {}
+  // readies a pooled connection for a newly accepted socket, outstr and out keep their capacity
+  void reset(int sock) {
+    socket = sock;
+    consumed = 0;
+    skip = 0;
+    parser.restart(0);
+    outstr.clear();
+    out.clear();
+    outHead = 0;
+    sending = NULL;
+    readable = 1;
+    parked = 0;
+    queued = 0;
+    closing = 0;
+    eof = 0;
+    idle = 0;
+    idlePrev = NULL;
+    idleNext = NULL;
+    lastActive = time(0);
+    wheelPrev = NULL;
+    wheelNext = NULL;
+    wheelSlot = -1;
+    job = NULL;
+    inflight = 0;
+    dead = 0;
+    sendInFlight = 0;
+  }
+  // gives back what a closed connection should not hold on to while it waits in the pool
+  void recycle() {
+    bufferPool.release(&inbuf);
+    free(chunk);
+    chunk = NULL;
+    retired.clear();
+    if (outstr.capacity() > REQ_SIZ) {
+      std::string().swap(outstr);
+      std::vector<OutPiece>().swap(out);
+    }
+  }
+  ~Connection() { bufferPool.release(&inbuf); free(chunk); }
+};
+
+/** Idle List
+ *  The connections of a worker that are waiting for their next request, oldest first, so that an
+ *  overloaded worker can make room by shedding the keep-alive least likely to be used again
+ */
+class IdleList
+{
+public:
+  IdleList(): head(NULL), tail(NULL) {}
+  void push(struct Connection *conn);
+  void remove(struct Connection *conn);
+  struct Connection *oldest() { return head; }
+
+private:
+  struct Connection *head;
+  struct Connection *tail;
+};
+
+thread_local IdleList idleConnections;
+
+/** Timer Wheel
+ *  Every connection of a worker sits in the slot of the second it could next time out. Activity
+ *  only refreshes lastActive, and when a slot comes due each connection in it is either closed or
+ *  moved on to the slot of its new deadline, so timeouts cost O(1) amortized per connection.
+ *  When the timeout shrinks under load the slots it no longer reaches are revisited at once
+ */
+
+class TimerWheel
+{
+public:
+  TimerWheel();
+  // schedules conn for lastActive plus the current timeout
+  void arm(struct Connection *conn);
+  // takes conn out of its slot
+  void disarm(struct Connection *conn);
+  // turns the wheel to now under the given timeout in seconds, returning how many connections expired
+  int advance(time_t now, time_t newTimeout);
+
+private:
+  int visit(int slot, time_t now);
+
+  struct Connection *slots[WHEEL_SLOTS];
+  time_t current; // the second the wheel has been turned to
+  time_t timeout; // the timeout, in seconds, connections are currently scheduled with
+};
+
+thread_local TimerWheel timerWheel;
+
+/** URing
+ *  A worker's io_uring, driven with raw system calls so nothing beyond the kernel headers is
+ *  needed. Submissions pile up in the ring and go to the kernel together with the wait for
+ *  completions, one io_uring_enter per pass of the reactor loop however many sockets were busy.
+ *  Receives draw from a ring of buffers registered once, so a connection waiting on its client
+ *  holds no buffer, and a worker whose buffers are all parked stops receiving until some return
+ */
+
+class URing
+{
+public:
+  URing(): parked(0), fd(-1), pending(0) {}
+  // creates the ring and registers the receive buffers, returning -1 if the kernel will not
+  int setup(unsigned entries);
+  // hands out the next free submission, making room for n in a row first, NULL on failure
+  struct io_uring_sqe *getSqe(unsigned n = 1);
+  // passes everything queued to the kernel, waiting up to timeoutMs for a completion if wait is set
+  int submit(int wait, int timeoutMs);
+  // the oldest completion not seen yet, or NULL
+  struct io_uring_cqe *peekCqe();
+  void seenCqe();
+  char *buffer(int bid) { return buffers + (size_t)bid * URING_BUFFER_SIZ; }
+  // lends a receive buffer back to the kernel
+  void recycleBuffer(int bid);
+  unsigned parked; // receive buffers held by connections instead of the kernel
+
+private:
+  int fd;
+  unsigned sqEntries;
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned pending; // submissions queued beyond what the kernel has been told about
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *bufRing;
+  char *buffers;
+  unsigned short bufTail;
+};
+
+thread_local URing uring;
+// connections whose receive ran out of buffers, re-armed once some are lent back
+thread_local std::vector<struct Connection*> starvedConnections;
+thread_local int acceptArmed;      // the multishot accept is outstanding
+thread_local int acceptCancelling; // the multishot accept is being cancelled to pause the listener
+thread_local time_t acceptBackoff; // no accept is armed before then, after running out of descriptors
+thread_local int wakeArmed;        // the multishot poll of the mailbox is outstanding
+
+/** Log Record
+ *  One entry of a LogRing: a formatted message, or an access record followed by its URI
+ */
+
+#define LOG_KIND_MESSAGE 0
+#define LOG_KIND_ACCESS 1
+
+struct LogRecord {
+  unsigned char kind;
+  unsigned char level;
+  unsigned short len;
+  char data[LOG_RECORD_SIZ - 4];
+};
+
+/** Access Record
+ *  The compact form of an access log line, written as is (followed by the URI) in binary mode
+ */
+
+struct AccessRecord {
+  uint32_t time;     // seconds since the epoch the request was answered
+  uint32_t micros;   // how long it took to answer
+  uint64_t bytes;    // length of the body
+  uint16_t status;
+  uint8_t method;    // 1 GET, 2 HEAD, 3 OPTIONS, 0 anything else
+  uint8_t urilen;    // bytes of URI following the record
+} __attribute__((packed));
+
+/** Log Ring
+ *  A single-producer single-consumer ring of LogRecords. Each thread that logs owns one and only
+ *  ever advances head, the log writer only ever advances tail, so neither side takes a lock.
+ *  When the writer falls behind, records are dropped and counted rather than blocking a worker
+ */
+
+struct LogRing {
+  LogRecord records[LOG_RING_SIZ];
+  std::atomic<size_t> head; // the next record the owning thread fills
+  std::atomic<size_t> tail; // the next record the log writer drains
+  std::atomic<size_t> dropped;
+
+  LogRing(): head(0), tail(0), dropped(0) {}
+};
+
+// every ring ever created, the lock is only taken when a thread logs for the first time and by the writer
+std::vector<LogRing*> logRings;
+std::mutex logRingsLock;
+thread_local LogRing *logRing = NULL;
+
+/** Histogram Structure
+ *  A log-linear latency histogram in the style of HdrHistogram. Values below 1 << HIST_SUB_BITS
+ *  get a bucket each, and every power of two above is split into 1 << HIST_SUB_BITS buckets, so
+ *  a value is known to within about 6%. Only the owning worker records, so a relaxed load and
+ *  store is enough, and anyone may read it while it is being written
+ */
+struct Histogram {
+  std::atomic<uint64_t> counts[HIST_BUCKETS];
+  std::atomic<uint64_t> sum;
+
+  Histogram() {
+    for (int i = 0; i < HIST_BUCKETS; i++) counts[i].store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+  }
+  void record(uint64_t value);
+  // the bucket a value falls in, and the largest value a bucket holds
+  static int bucketFor(uint64_t value);
+  static uint64_t bucketTop(int bucket);
+};
+
+/** Worker Stats Structure
+ *  The counters and gauges of one worker. Each is only ever written by its worker, without
+ *  locks or read-modify-write instructions, and /__stats sums them over every worker
+ */
+struct WorkerStats {
+  std::atomic<uint64_t> requests[METHODS][STATUS_SLOTS];
+  std::atomic<uint64_t> bytesSent;
+  std::atomic<uint64_t> cacheHits;
+  std::atomic<uint64_t> cacheMisses;
+  std::atomic<uint64_t> accepted;
+  std::atomic<uint64_t> rejected;  // connections turned away with a 503 while overloaded
+  std::atomic<uint64_t> shed;      // idle connections closed to make room for new ones
+  std::atomic<uint64_t> offloaded; // lookups and reads handed to the porters
+  std::atomic<int64_t> open;       // connections open right now
+  std::atomic<int64_t> idle;       // open connections waiting for their next request
+  std::atomic<int64_t> queueDepth; // requests read and not yet answered after the last reactor wakeup
+  Histogram parse;                 // nanoseconds to parse a request header
+  Histogram header;                // nanoseconds to build a response header
+  Histogram lastByte;              // nanoseconds from reading a request to its last byte
+
+  WorkerStats() {
+    for (int m = 0; m < METHODS; m++) {
+      for (int c = 0; c < STATUS_SLOTS; c++) requests[m][c].store(0, std::memory_order_relaxed);
+    }
+    bytesSent.store(0, std::memory_order_relaxed);
+    cacheHits.store(0, std::memory_order_relaxed);
+    cacheMisses.store(0, std::memory_order_relaxed);
+    accepted.store(0, std::memory_order_relaxed);
+    rejected.store(0, std::memory_order_relaxed);
+    shed.store(0, std::memory_order_relaxed);
+    offloaded.store(0, std::memory_order_relaxed);
+    open.store(0, std::memory_order_relaxed);
+    idle.store(0, std::memory_order_relaxed);
+    queueDepth.store(0, std::memory_order_relaxed);
+  }
+};
+
+// the status codes with a slot of their own, the last slot is every other code
+static const int statusCodes[STATUS_SLOTS - 1] = { 200, 206, 304, 400, 403, 404, 416, 501, 503 };
+
+// the statistics of every worker, the lock is only taken when a worker starts and by /__stats
+std::vector<WorkerStats*> allStats;
+std::mutex allStatsLock;
+thread_local WorkerStats *stats = NULL;
+
+// adds n to a counter only the calling worker writes
+template <class T>
+static inline void bump(std::atomic<T> &counter, T n)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/** Request Structure
+ *  This contains all the information in a request, and are loaded into the event queue
+ *  It encapsulates all the necessary information for a request in one structure
+ */
+
+struct Request {
+  struct Connection *conn;
+  int socket;
+  std::string method;
+  int methodCode; // one of the METHOD_ codes, so the method is never compared as a string again
+  std::string requestURI;
+  std::string path;   // the URI decoded and without its query, what the file and every cache go by
+  std::string version;
+  RequestParser parser;
+  int file; // descriptor of the requested file, opened once and kept until the request is released
+  struct OpenFile *opened; // the shared descriptor file belongs to, NULL when the request owns it
+  int deferred;       // a porter already looked the path up, so it is not handed over again
+  off_t warmTo;       // the file is known to be in the page cache up to here
+  std::shared_ptr<struct CachedFile> cached; // set instead of file when the body is served from memory
+  off_t filesize;     // where the body ends in the file, the whole file unless a range was asked for
+  off_t filepos;      // where the body starts, and then how far it has been sent
+  off_t fullsize;     // size of the whole file, for validators and Content-Range
+  off_t bodylen;      // the Content-Length that was sent, for the access log
+  time_t mtime;       // last modification of the file, 0 when the response is not for a file
+  int continues;
+  int framed;         // the body, if there is one, can be skipped, so more requests may follow this one
+  int encoding;       // the ENCODING_ the body is sent in
+  int status;         // the status code of the response, for the access log
+  long long started;  // when the request was read, in microseconds
+  
+  Request():conn(NULL),
+	    socket(-1),
+	    method(),
+	    methodCode(METHOD_OTHER),
+	    requestURI(),
+	    path(),
+	    version(),
+	    parser(),
+	    file(-1),
+	    opened(NULL),
+	    deferred(0),
+	    warmTo(0),
+	    cached(),
+	    filesize(0),
+	    filepos(0),
+	    fullsize(0),
+	    bodylen(0),
+	    mtime(0),
+	    continues(0),
+	    framed(1),
+	    encoding(ENCODING_IDENTITY),
+	    status(0),
+	    started(0) {}
+  // readies a pooled request for the one just parsed on c, the strings keep their capacity
+  void reset(struct Connection *c, const RequestParser &p) {
+    conn = c;
+    socket = c->socket;
+    method.clear();
+    methodCode = METHOD_OTHER;
+    requestURI.clear();
+    path.clear();
+    version.clear();
+    parser = p;
+    file = -1;
+    opened = NULL;
+    deferred = 0;
+    warmTo = 0;
+    filesize = 0;
+    filepos = 0;
+    fullsize = 0;
+    bodylen = 0;
+    mtime = 0;
+    continues = 0;
+    framed = 1;
+    encoding = ENCODING_IDENTITY;
+    status = 0;
+    started = nowMicros();
+  }
+  // lets go of the cached body, and of strings a freak request blew up, before going back to the pool
+  void recycle() {
+    cached.reset();
+    if (requestURI.capacity() > REQ_SIZ) std::string().swap(requestURI);
+    if (path.capacity() > REQ_SIZ) std::string().swap(path);
+    if (method.capacity() > REQ_SIZ) std::string().swap(method);
+    if (version.capacity() > REQ_SIZ) std::string().swap(version);
+  }
+};
+
+/** Object Pool
+ *  Requests and Connections are recycled through a per-worker free list instead of going back to
+ *  the heap, so the strings and vectors inside them keep the capacity they grew to and a warm
+ *  worker allocates nothing per request. At most keep spares are held, and the rest are deleted
+ *  so that a burst does not pin its peak memory forever
+ */
+template <class T>
+class ObjectPool
+{
+public:
+  ObjectPool(size_t k): keep(k), out(0) { spare.reserve(k); }
+  ~ObjectPool() {
+    for (size_t i = 0; i < spare.size(); i++) delete spare[i];
+  }
+  // hands out a spare object, only reaching for the heap when there is none
+  T *acquire() {
+    out++;
+    if (spare.empty()) return new T();
+    T *obj = spare.back();
+    spare.pop_back();
+    return obj;
+  }
+  void release(T *obj) {
+    out--;
+    obj->recycle();
+    if (spare.size() < keep) {
+      spare.push_back(obj);
+    } else {
+      delete obj;
+    }
+  }
+  // objects handed out and not given back yet
+  size_t inUse() const { return out; }
+
+private:
+  std::vector<T*> spare;
+  size_t keep;
+  size_t out;
+};
+
+thread_local ObjectPool<Request> requestPool(POOL_KEEP);
+thread_local ObjectPool<Connection> connectionPool(POOL_KEEP);
+
+/** Mime Type Structure
+ *  One extension and its content type. The built-in ones are kept sorted by extension, and
+ *  loadMimeTypes merges them with any from the config file into the table that is searched
+ */
+struct MimeType {
+  const char *ext;
+  const char *type;
+};
+
+static const MimeType builtinMimeTypes[] = {
+  { "7z", "application/x-7z-compressed" },
+  { "aac", "audio/aac" },
+  { "apng", "image/apng" },
+  { "avif", "image/avif" },
+  { "bmp", "image/bmp" },
+  { "css", "text/css" },
+  { "csv", "text/csv" },
+  { "eot", "application/vnd.ms-fontobject" },
+  { "gif", "image/gif" },
+  { "gz", "application/gzip" },
+  { "htm", "text/html" },
+  { "html", "text/html" },
+  { "ico", "image/x-icon" },
+  { "ics", "text/calendar" },
+  { "jpeg", "image/jpeg" },
+  { "jpg", "image/jpeg" },
+  { "js", "text/javascript" },
+  { "json", "application/json" },
+  { "jsonld", "application/ld+json" },
+  { "m4a", "audio/mp4" },
+  { "m4r", "audio/m4r" },
+  { "map", "application/json" },
+  { "md", "text/markdown" },
+  { "mjs", "text/javascript" },
+  { "mp3", "audio/mpeg" },
+  { "mp4", "video/mp4" },
+  { "mpeg", "video/mpeg" },
+  { "oga", "audio/ogg" },
+  { "ogg", "audio/ogg" },
+  { "ogv", "video/ogg" },
+  { "otf", "font/otf" },
+  { "pdf", "application/pdf" },
+  { "png", "image/png" },
+  { "rss", "application/rss+xml" },
+  { "svg", "image/svg+xml" },
+  { "tar", "application/x-tar" },
+  { "tif", "image/tiff" },
+  { "tiff", "image/tiff" },
+  { "ttf", "font/ttf" },
+  { "txt", "text/plain" },
+  { "wasm", "application/wasm" },
+  { "wav", "audio/wav" },
+  { "weba", "audio/webm" },
+  { "webm", "video/webm" },
+  { "webmanifest", "application/manifest+json" },
+  { "webp", "image/webp" },
+  { "woff", "font/woff" },
+  { "woff2", "font/woff2" },
+  { "xhtml", "application/xhtml+xml" },
+  { "xml", "application/xml" },
+  { "zip", "application/zip" },
+};
+
+// the table contentTypeForFile searches, built once in main and only read by the workers
+std::vector<MimeType> mimeTypes;
+
+/** Cached File Structure
+ *  A small file held in memory with everything needed to answer for it without touching the disk
+ */
+struct CachedFile {
+  std::string path;
+  std::string body;
+  const char *data;          // where the body is, in body or in the preload arena
+  off_t size;
+  time_t mtime;
+  time_t checked;            // the last second the mtime was compared against the disk
+  const char *contentType;
+  std::string fields;        // the Content-Type and Content-Length lines, rendered once on insert
+  std::shared_ptr<CachedFile> encoded[ENCODINGS]; // compressed variants, made the first time one is asked for
+  int encodedTried;          // a bit per encoding that was attempted, whether or not it paid off
+  int encodedPending;        // a bit per encoding a porter is making right now
+};
+
+/** File Cache
+ *  A bounded LRU of CachedFiles keyed by path. Every worker owns one, so it needs no locking,
+ *  and requests hold a reference to their entry so eviction never pulls a body out from under a send
+ */
+class FileCache
+{
+public:
+  FileCache(size_t cap): capacity(cap), used(0) {}
+  // returns the entry for path if it is cached and still matches the file on disk
+  std::shared_ptr<CachedFile> lookup(const std::string &path);
+  // reads the open file into the cache, returning NULL if it is too large to keep
+  std::shared_ptr<CachedFile> insert(const std::string &path, int file);
+  // returns the entry compressed with encoding, from a .gz sibling or zlib, or NULL if it does not pay
+  std::shared_ptr<CachedFile> encode(std::shared_ptr<CachedFile> entry, int encoding);
+  // keeps a variant of the entry that a porter made, NULL if it did not pay
+  void adopt(std::shared_ptr<CachedFile> entry, int encoding, std::shared_ptr<CachedFile> variant);
+
+private:
+  typedef std::list<std::shared_ptr<CachedFile> > LRUList;
+  void evict(LRUList::iterator entry);
+
+  LRUList lru; // most recently used at the front
+  std::unordered_map<std::string, LRUList::iterator> index;
+  size_t capacity;
+  size_t used;
+};
+
+thread_local FileCache fileCache(CACHE_SIZ);
+
+/** Path Cache
+ *  What each decoded path resolved to under the document root, either the stat of a readable file
+ *  or the status it got instead, kept for a few seconds so that repeated requests, and scanners
+ *  probing for paths that do not exist, skip the filesystem. Resolution happens beneath rootFd,
+ *  so no spelling of .. and no symlink gets outside the root
+ */
+class PathCache
+{
+public:
+  PathCache(size_t cap): capacity(cap) {}
+  // fills in the stat of the file behind path and returns 200, or returns 403 or 404. When file
+  // is given and the disk had to be consulted, the descriptor that was opened to do so is handed
+  // over in it, otherwise it is set to -1
+  int resolve(const std::string &path, struct stat *s, int *file);
+  // opens the file behind path for reading and refreshes its stat, returning -1 if that fails
+  int open(const std::string &path, struct stat *s);
+  // drops what is known about path
+  void forget(const std::string &path) { entries.erase(path); }
+  // records how path resolved, s is only looked at for a 200
+  void remember(const std::string &path, int status, const struct stat *s);
+  // whether path resolves without consulting the disk
+  int fresh(const std::string &path);
+
+private:
+  struct PathEntry {
+    int status;
+    struct stat s;
+    time_t expires;
+  };
+
+  std::unordered_map<std::string, PathEntry> entries;
+  size_t capacity;
+};
+
+thread_local PathCache pathCache(PATH_CACHE_SIZ);
+
+/** Open File Cache
+ *  Descriptors of files too large for the hot-file cache, kept open and shared by every request of
+ *  the worker that sends the same file. sendfile and io_uring reads are given the offset explicitly,
+ *  so requests never disturb each other's position. An entry is only reused while it matches the
+ *  stat the path cache has for it, and one nobody has sent from for FD_IDLE seconds is closed
+ */
+struct OpenFile {
+  std::string path;
+  int fd;
+  off_t size;
+  time_t mtime;
+  ino_t ino;
+  int refs;         // requests sending from fd
+  time_t idleSince; // when refs last dropped to zero
+  int cached;       // still the entry for path, a replaced or surplus one is closed once refs drops to zero
+};
+
+class FdCache
+{
+public:
+  FdCache(size_t cap): capacity(cap) {}
+  // returns the shared descriptor for path, opening it unless one matching s is open already. file is
+  // a descriptor the caller already opened for path, or -1, and s is refreshed when a new one is used
+  struct OpenFile *acquire(const std::string &path, struct stat *s, int file);
+  void release(struct OpenFile *open);
+  // closes the descriptors nobody has sent from since before now - idle
+  void expire(time_t now, time_t idle);
+
+private:
+  void drop(struct OpenFile *open);
+
+  std::unordered_map<std::string, struct OpenFile*> entries;
+  size_t capacity;
+};
+
+thread_local FdCache fdCache(FD_CACHE_SIZ);
+
+/** Blocking Job
+ *  Filesystem work a worker hands to the porters rather than stall its reactor on a cold disk. A
+ *  resolve looks up the path of a request and reads the start of the file and of its .gz sibling,
+ *  a read pulls the next piece of a file being sent into the page cache. Only the stat comes back,
+ *  the worker then does the work itself, which the warm caches answer without waiting. An encode
+ *  compresses a cached body, or opens the .gz sibling of a file too big for the cache, and hands
+ *  back the result, since zlib at its best compression costs the worker far more than a cold disk
+ */
+struct BlockingJob {
+  int kind;                  // JOB_RESOLVE, JOB_READ or JOB_ENCODE
+  struct Connection *conn;
+  struct Request *req;       // the request that waits for the job
+  struct Mailbox *mailbox;   // where the worker that submitted it collects it
+  std::string path;          // the resolve, and what it found
+  int status;
+  struct stat s;
+  int file;                  // the read
+  off_t offset;
+  off_t len;
+  int encoding;              // the encode, of a cached entry or else of file into its sibling
+  std::shared_ptr<CachedFile> entry;
+  std::shared_ptr<CachedFile> variant;
+  int sibling;
+};
+
+/** Mailbox
+ *  Where the porters leave the finished jobs of a worker, knocking on the eventfd its reactor watches
+ */
+struct Mailbox {
+  std::mutex lock;
+  std::vector<struct BlockingJob*> done;
+  int fd; // -1 while the worker does everything inline
+
+  Mailbox(): lock(), done(), fd(-1) {}
+};
+
+thread_local Mailbox mailbox;
+
+/** Blocking Pool
+ *  The porters. Each owns a lane of jobs, the workers deal their jobs out over the lanes, and a
+ *  porter whose lane is empty steals from the back of the others', so a read stuck on the disk
+ *  holds up nothing queued behind it while another porter is free. The semaphore counts the jobs
+ *  no porter has taken yet, and an idle porter sleeps on it
+ */
+class BlockingPool
+{
+public:
+  BlockingPool(): lanes(), next(0) {}
+  // starts the porters, which run for as long as the server does
+  void start(int threads);
+  int running() { return !lanes.empty(); }
+  void submit(struct BlockingJob *job);
+
+private:
+  struct Lane {
+    std::mutex lock;
+    std::deque<struct BlockingJob*> jobs;
+  };
+  void porter(size_t self);
+  struct BlockingJob *take(size_t self);
+
+  std::vector<std::unique_ptr<Lane> > lanes;
+  sem_t waiting;
+  std::atomic<size_t> next;
+};
+
+BlockingPool blockingPool;
 
-// This method returns the content type
-std::string contentTypeForFile(std::string filename);
+/** Document Index
+ *  Every servable file under the document root, found by one walk at startup and sorted by path so
+ *  a lookup is a binary search with no system call. Paths are packed into a single string. With
+ *  PRELOAD_CONTENTS the small files are also read into one contiguous, read-only arena and come with
+ *  their compressed variants, so they are answered straight from memory. Any other file is served
+ *  from disk the usual way, which the page cache, asked to read ahead at build, speeds up, while a
+ *  path the index lacks is a 404 without a system call, so files added later wait for a SIGHUP. An
+ *  index never changes once built, all workers share it, and a SIGHUP builds a new one that replaces it whole
+ */
+struct IndexEntry {
+  uint32_t name;     // where the path starts in names
+  uint32_t nameLen;
+  off_t size;
+  time_t mtime;
+  struct CachedFile *file; // the preloaded body, NULL when it has to be read from disk
+};
 
-// This method returns the UPPERCASE version of the inputted string
-std::string strToUpper(std::string given);
+class DocIndex
+{
+public:
+  DocIndex(): arena(NULL), arenaLen(0) {}
+  ~DocIndex() { if (arena != NULL) munmap(arena, arenaLen); }
+  // walks the document root, reading small files into the arena if contents is set
+  static std::shared_ptr<DocIndex> build(int contents);
+  // returns the entry for a path relative to the root, or NULL
+  const IndexEntry *find(const std::string &path) const;
+  size_t files() const { return entries.size(); }
+  size_t preloaded() const { return arenaLen; }
 
-// This method ensures that the incoming request is of the proper form
-int regexGuard(std::string reqstr); //, std::regex e);
+private:
+  void walk(int dir, const std::string &prefix);
 
-// This method ensures that the requested URI is allowed to be accessed
-std::string URIGuard(std::string handle);
+  std::string names;
+  std::vector<IndexEntry> entries;
+  std::deque<CachedFile> bodies; // a deque, so the entries pointing into it stay valid as it grows
+  std::vector<std::pair<dev_t, ino_t> > walking; // the directories walk is inside of, only while building
+  char *arena;
+  size_t arenaLen;
+};
 
-// This method determines the length of a file
-int fileLength(std::ifstream &file);
+// the index every worker answers from, replaced whole by the librarian, NULL without preloading
+std::shared_ptr<DocIndex> docIndex;
+std::atomic<unsigned> indexGeneration(0); // bumped every time docIndex is replaced
+// the index this worker uses, swapped for docIndex on the tick after it changes, so lookups never lock
+thread_local std::shared_ptr<DocIndex> workerIndex;
+thread_local unsigned workerGeneration;
 
-// This method returns a string with the current date and time
-const std::string currentDateTime();
+/**
+ * Forever loop: 
+ *   Wait on the reactor for any socket to become ready (Done)
+ *   Accept new connections from incoming clients without blocking (Done)
+ *   Read HTTP requests as their bytes arrive (Done)
+ *   Ensure well-formed request (return error otherwise) (Done) 
+ *   Determine if target file exists and if permissions are set properly (return error otherwise) (Done)
+ *   Transmit contents of file to connect whenever the socket is writable (Done) 
+ *   Close the connection (if HTTP/1.0) (Done)
+ */
+int mainListener(int port)
+{
+  // This is the main socket that all incoming connections come through
+  int mainSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  struct sockaddr_in my_addr;
+  my_addr.sin_family = AF_INET;
+  my_addr.sin_port = htons(port);
+  my_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  int uno = 1;
+  setsockopt(mainSock,SOL_SOCKET, SO_REUSEADDR, &uno, sizeof(uno));
+  // every worker binds its own listener to the port and the kernel spreads connections across them
+  setsockopt(mainSock,SOL_SOCKET, SO_REUSEPORT, &uno, sizeof(uno));
+  if (bind(mainSock, (struct sockaddr *)&my_addr, sizeof(my_addr)) == -1) {
+    logFatal("could not bind to port %d: %s", port, strerror(errno));
+  }
+  listen(mainSock, listenBacklog);
+  setNonBlocking(mainSock);
+  registerStats();
+  refreshIndex();
+  if (blockingPool.running()) {
+    // the porters knock on this when a job of this worker is done, without it everything is inline
+    mailbox.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  }
+  if (ioBackend == IO_URING) {
+    // only comes back if the kernel has no usable io_uring
+    uringListener(mainSock);
+    logMessage(LOG_ERROR, "io_uring is unavailable, falling back to epoll");
+  }
+
+  // every socket is registered edge-triggered, the listening socket is marked by a NULL request
+  // and the mailbox of the porters by itself
+  epollFd = epoll_create1(0);
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, mainSock, &ev) == -1) {
+    logFatal("could not watch the listening socket: %s", strerror(errno));
+  }
+  if (mailbox.fd != -1) {
+    ev.data.ptr = &mailbox;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, mailbox.fd, &ev) == -1) {
+      logFatal("could not watch the porter mailbox: %s", strerror(errno));
+    }
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  time_t lastTick = time(0);
+  refreshDate(lastTick);
+  // This infinite while loop handles all server operations
+  while(true)
+    {
+      // only sleep when nothing is left waiting in the event queue or the listener, and never past
+      // the next tick, a paused listener is left alone until connections close
+      int acceptNow = acceptPending && ((overloadPolicy != OVERLOAD_PAUSE) || !isOverloaded());
+      int ready = epoll_wait(epollFd, events, MAX_EVENTS,
+			     (eventQueue.empty() && !acceptNow) ? TICK_INTERVAL : 0);
+      // finished jobs are only taken back once the batch is done, serving them can close connections
+      // that later events of the same batch still point at
+      int jobsDone = 0;
+      for (int i = 0; i < ready; i++) {
+	struct Connection *conn = (struct Connection*) events[i].data.ptr;
+	if (conn == NULL) {
+	  acceptPending = 1;
+	} else if (events[i].data.ptr == &mailbox) {
+	  jobsDone = 1;
+	} else {
+	  connectionEvent(conn, events[i].events);
+	}
+      }
+      if (jobsDone) {
+	collectJobs();
+      }
+      if (acceptPending) {
+	acceptConnections(mainSock);
+      }
+      stats->queueDepth.store(requestPool.inUse(), std::memory_order_relaxed);
+      eventProcessor();
+      if (time(0) != lastTick) {
+	lastTick = time(0);
+	refreshDate(lastTick);
+	refreshIndex();
+	fdCache.expire(lastTick, FD_IDLE);
+	timerWheel.advance(lastTick, (getTimeout() + 999) / 1000);
+      }
+    }
+}
+
+// accepts a batch at a time, the edge-triggered listener stays pending until accept runs dry
+int acceptConnections(int mainSock)
+{
+  int accepted = 0;
+  while (accepted < acceptBatch) {
+    int reject = 0;
+    if (isOverloaded()) {
+      // idle keep-alives are the cheapest to lose, so they make room before anyone is turned away
+      if ((connectionsOpen >= maxConnections) && shedIdleConnection()) {
+	continue;
+      }
+      if (overloadPolicy == OVERLOAD_PAUSE) {
+	// the rest wait in the kernel's backlog until this worker has room again
+	return accepted;
+      }
+      reject = 1;
+    }
+    int newSock = accept4(mainSock, NULL, NULL, SOCK_NONBLOCK);
+    if (newSock == -1) {
+      if (errno == EINTR) continue;
+      // EAGAIN means the backlog is empty, anything else is dropped with the connection
+      acceptPending = 0;
+      break;
+    }
+    accepted++;
+    if (reject) {
+      rejectConnection(newSock);
+    } else {
+      openConnection(newSock);
+    }
+  }
+  return accepted;
+}
+
+void openConnection(int newSock)
+{
+  connectionsOpen++;
+  bump(stats->open, (int64_t)1);
+  bump(stats->accepted, (uint64_t)1);
+  struct Connection *conn = connectionPool.acquire();
+  conn->reset(newSock);
+  if ((size_t)newSock >= connectionTable.size()) {
+    connectionTable.resize(newSock + 1, NULL);
+  }
+  connectionTable[newSock] = conn;
+  timerWheel.arm(conn);
+  // responses are written whole, or held back with MSG_MORE, so Nagle would only delay their tails
+  int uno = 1;
+  setsockopt(newSock, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+  if (ioBackend == IO_URING) {
+    // nothing is read until a receive completes
+    conn->readable = 0;
+    uringArmRecv(conn);
+  } else {
+    watchConnection(epollFd, conn);
+  }
+}
+
+// a fast 503 tells the client to come back later, instead of letting it time out in the backlog
+void rejectConnection(int newSock)
+{
+  char discard[REQ_SIZ];
+  send(newSock, overloadResponse, sizeof(overloadResponse) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+  while (recv(newSock, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+  close(newSock);
+  bump(stats->rejected, (uint64_t)1);
+}
+
+//a request is in use from being parsed until its response is queued whole, so files streaming to slow
+//clients and lookups waiting on the porters are what fill a worker up, under either backend
+int isOverloaded()
+{
+  return (connectionsOpen >= maxConnections) || (requestPool.inUse() >= queueCap);
+}
+
+int shedIdleConnection()
+{
+  struct Connection *conn = idleConnections.oldest();
+  if (conn == NULL) {
+    return 0;
+  }
+  logMessage(LOG_DEBUG, "shedding idle connection on socket: %d", conn->socket);
+  bump(stats->shed, (uint64_t)1);
+  closeConnection(conn);
+  return 1;
+}
+
+void IdleList::push(struct Connection *conn)
+{
+  conn->idlePrev = tail;
+  conn->idleNext = NULL;
+  if (tail != NULL) tail->idleNext = conn;
+  else head = conn;
+  tail = conn;
+}
+
+void IdleList::remove(struct Connection *conn)
+{
+  if (conn->idlePrev != NULL) conn->idlePrev->idleNext = conn->idleNext;
+  else head = conn->idleNext;
+  if (conn->idleNext != NULL) conn->idleNext->idlePrev = conn->idlePrev;
+  else tail = conn->idlePrev;
+  conn->idlePrev = NULL;
+  conn->idleNext = NULL;
+}
+
+void connectionEvent(struct Connection *conn, uint32_t events)
+{
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    conn->readable = 1;
+  }
+  if (conn->queued) {
+    // the event processor gets to it on this pass
+    return;
+  }
+  if (conn->parked) {
+    // new requests wait behind the responses already queued, until those can be written
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+    conn->parked = 0;
+  }
+  serveConnection(conn);
+}
+
+// reads until the socket would block or the buffer is as large as it may get
+int readConnection(struct Connection *conn)
+{
+  struct ReadBuffer *in = &conn->inbuf;
+  if (in->data == NULL) {
+    bufferPool.acquire(in, REQ_SIZ);
+  }
+  while (true) {
+    if (in->len == in->cap) {
+      if (conn->consumed > 0) {
+	// requests already answered make room, the partial one behind them is parsed again from the start
+	in->len -= conn->consumed;
+	memmove(in->data, in->data + conn->consumed, in->len);
+	conn->consumed = 0;
+	conn->parser.restart(0);
+	continue;
+      }
+      if (!bufferPool.grow(in)) {
+	// the header has outgrown the largest buffer, serveConnection decides what that means
+	return 1;
+      }
+    }
+    int got = recv(conn->socket, in->data + in->len, in->cap - in->len, 0);
+    if (got > 0) {
+      in->len += got;
+      conn->lastActive = time(0);
+    } else if (got == -1 && errno == EINTR) {
+      continue;
+    } else if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      conn->readable = 0;
+      return 0;
+    } else {
+      // the client hung up (or the socket failed), whatever it sent completely is still answered
+      conn->readable = 0;
+      conn->eof = 1;
+      return 0;
+    }
+  }
+}
+
+void serveConnection(struct Connection *conn)
+{
+  if (conn->job != NULL) {
+    // everything waits for the porters, collectJobs serves the connection once they are done
+    return;
+  }
+  int answered = 0;
+  if (conn->idle) {
+    conn->idle = 0;
+    idleConnections.remove(conn);
+    bump(stats->idle, (int64_t)-1);
+  }
+  while (true) {
+    if (conn->readable) {
+      readConnection(conn);
+    }
+
+    // every complete request received so far is answered in order, and their responses pile up in
+    // the queue, until one streams a file or ends the connection
+    int batch = 0;
+    while ((conn->sending == NULL) && (conn->job == NULL) && !conn->closing) {
+      if (conn->skip > 0) {
+	// the body of the request before is thrown away as it arrives, so it is never parsed as a request
+	unsigned long long take = conn->inbuf.len - conn->consumed;
+	if (take > conn->skip) take = conn->skip;
+	conn->consumed += take;
+	conn->skip -= take;
+	conn->parser.restart(conn->consumed);
+	if (conn->skip > 0) break;
+      }
+      long long parseStart = nowNanos();
+      int parsed = parseRequest(&conn->parser, conn->inbuf.data, conn->inbuf.len);
+      if (parsed != PARSE_INCOMPLETE) {
+	stats->parse.record(nowNanos() - parseStart);
+      }
+      if (parsed == PARSE_INCOMPLETE) {
+	if (conn->inbuf.len - conn->consumed >= MAX_REQ_SIZ) {
+	  logMessage(LOG_INFO, "request header too large, dropping client on socket %d", conn->socket);
+	  closeConnection(conn);
+	  return;
+	}
+	break;
+      }
+      logMessage(LOG_DEBUG, "request on socket %d:\n%.*s", conn->socket,
+		 (int)(conn->parser.pos - conn->consumed), conn->inbuf.data + conn->consumed);
+      struct Request *curReq = requestPool.acquire();
+      curReq->reset(conn, conn->parser);
+      if (parsed == PARSE_DONE) {
+	// a body that cannot be told apart from what follows it ends the connection after the response
+	curReq->framed = bodyLength(&conn->parser, conn->inbuf.data, &conn->skip);
+      }
+      conn->consumed = conn->parser.pos;
+      conn->parser.restart(conn->consumed);
+      handleRequest(curReq);
+      batch++;
+    }
+    answered += batch;
+
+    int streaming = (conn->sending != NULL);
+    int flushed = flushConnection(conn);
+    if (flushed == -1) {
+      //the client went away in the middle of a response
+      closeConnection(conn);
+      return;
+    }
+    if (flushed == 0) {
+      // parked until the socket is writable, or queued behind the other connections
+      return;
+    }
+    if (conn->closing) {
+      closeConnection(conn);
+      return;
+    }
+    if (conn->job != NULL) {
+      // the request handed to the porters is still in inbuf, so nothing more is read until it is back
+      return;
+    }
+    if (!batch && !streaming && !conn->readable) {
+      break;
+    }
+  }
+
+  if (conn->eof && conn->parkedBufs.empty()) {
+    closeConnection(conn);
+  } else if ((answered || conn->consumed) && (conn->consumed == conn->inbuf.len)) {
+    // everything was answered, in this pass or by responses that have only now gone out, and nothing
+    // new has arrived, so the connection goes idle in the reactor, holding on to as little memory as
+    // possible until the client speaks again
+    bufferPool.release(&conn->inbuf);
+    conn->consumed = 0;
+    conn->parser.restart(0);
+    if (conn->outstr.capacity() > REQ_SIZ) {
+      std::string().swap(conn->outstr);
+      std::vector<OutPiece>().swap(conn->out);
+    }
+    conn->idle = 1;
+    idleConnections.push(conn);
+    bump(stats->idle, (int64_t)1);
+  }
+}
+
+int flushConnection(struct Connection *conn)
+{
+  if (ioBackend == IO_URING) {
+    return uringFlush(conn);
+  }
+  // the queued pieces go out MAX_IOV at a time, so a batch of small responses is a single sendmsg
+  while (conn->outHead < conn->out.size()) {
+    struct iovec iov[MAX_IOV];
+    int n = 0;
+    for (size_t i = conn->outHead; (i < conn->out.size()) && (n < MAX_IOV); i++, n++) {
+      struct OutPiece &piece = conn->out[i];
+      const char *base = piece.body ? piece.body->data : conn->outstr.data();
+      iov[n].iov_base = (void*)(base + piece.start);
+      iov[n].iov_len = piece.len;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    ssize_t sent = sendmsg(conn->socket, &msg, moreFlag(conn, conn->outHead + n));
+    if (sent == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	//the socket is full, the reactor resumes us once it is writable again
+	conn->parked = 1;
+	return 0;
+      }
+      return -1;
+    }
+    advanceOutput(conn, sent);
+  }
+  conn->out.clear();
+  conn->outstr.clear();
+  conn->outHead = 0;
+
+  if (conn->sending != NULL) {
+    int sent = sendFile(conn->sending);
+    if (sent != 1) {
+      return sent;
+    }
+    //we are done with the file, just check if we need to continue listening to the client
+    struct Request *curReq = conn->sending;
+    conn->sending = NULL;
+    finishRequest(curReq);
+  }
+  return 1;
+}
+
+void advanceOutput(struct Connection *conn, size_t sent)
+{
+  conn->lastActive = time(0);
+  bump(stats->bytesSent, (uint64_t)sent);
+  // pieces that were written completely are dropped, and one cut short is trimmed
+  while (sent > 0) {
+    struct OutPiece &piece = conn->out[conn->outHead];
+    if (sent >= piece.len) {
+      sent -= piece.len;
+      piece.body.reset();
+      conn->outHead++;
+    } else {
+      piece.start += sent;
+      piece.len -= sent;
+      sent = 0;
+    }
+  }
+}
+
+// a header followed by a file is held back so it leaves in the same segment as the start of the body,
+// which sendfile pushes out once it reaches the end of what it was asked to send
+int moreFlag(struct Connection *conn, size_t last)
+{
+  struct Request *curReq = conn->sending;
+  if ((last == conn->out.size()) && (curReq != NULL) && (curReq->filepos < curReq->filesize)) {
+    return MSG_MORE;
+  }
+  return 0;
+}
+
+// asks for the first and last byte of the range without waiting, as a cheap guess at whether it is cached
+static int isResident(int file, off_t start, off_t end)
+{
+  char probe;
+  struct iovec iov;
+  iov.iov_base = &probe;
+  iov.iov_len = 1;
+  if ((preadv2(file, &iov, 1, start, RWF_NOWAIT) == -1) && (errno == EAGAIN)) return 0;
+  if ((preadv2(file, &iov, 1, end - 1, RWF_NOWAIT) == -1) && (errno == EAGAIN)) return 0;
+  return 1;
+}
+
+//streams the file with sendfile until the socket is full, returning 1 once all of it is sent
+int sendFile(struct Request *curReq)
+{
+  // each call asks for everything that is left so the kernel fills the whole socket buffer,
+  // filepos is advanced by what it really sent
+  off_t budget = SEND_BUDGET;
+  while (curReq->filepos < curReq->filesize) {
+    off_t left = curReq->filesize - curReq->filepos;
+    off_t count = left < budget ? left : budget;
+    if (mailbox.fd != -1) {
+      // sendfile would wait for the disk on pages that are not in memory, a porter reads them first
+      if (curReq->warmTo <= curReq->filepos) {
+	off_t end = curReq->filepos + (count < WARM_SIZ ? count : WARM_SIZ);
+	if (!isResident(curReq->file, curReq->filepos, end)) {
+	  deferRead(curReq, end - curReq->filepos);
+	  return 0;
+	}
+	curReq->warmTo = end;
+      }
+      if (count > curReq->warmTo - curReq->filepos) count = curReq->warmTo - curReq->filepos;
+    }
+    ssize_t sent = sendfile(curReq->socket, curReq->file, &curReq->filepos, count);
+    if (sent == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	//the socket is full, the reactor resumes us once it is writable again
+	curReq->conn->parked = 1;
+	return 0;
+      }
+      //the client went away in the middle of the transfer
+      return -1;
+    }
+    if (sent == 0) {
+      //the file was truncated underneath us, the promised length can no longer be honoured
+      return -1;
+    }
+    curReq->conn->lastActive = time(0);
+    bump(stats->bytesSent, (uint64_t)sent);
+    budget -= sent;
+    if (budget <= 0 && curReq->filepos < curReq->filesize) {
+      //a fast client on a huge file goes to the back of the queue instead of starving the others
+      curReq->conn->queued = 1;
+      eventQueue.push(curReq->conn);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int watchConnection(int reactor, struct Connection *conn)
+{
+  // writability is watched from the start, edge triggering only reports it after a send blocked
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = conn;
+  if (epoll_ctl(reactor, EPOLL_CTL_ADD, conn->socket, &ev) == -1) {
+    closeConnection(conn);
+    return -1;
+  }
+  return 0;
+}
+
+//This is where we cycle through the events in the queue, leaving anything requeued for the next pass
+int eventProcessor(){
+  for (size_t pending = eventQueue.size(); pending > 0; pending--) {
+    struct Connection *conn = eventQueue.front();
+    eventQueue.pop();
+    conn->queued = 0;
+    serveConnection(conn);
+  }
+
+  return 0;
+}
+
+void finishRequest(struct Request *curReq)
+{
+  logAccess(curReq);
+  int slot = 0;
+  while ((slot < STATUS_SLOTS - 1) && (statusCodes[slot] != curReq->status)) slot++;
+  bump(stats->requests[curReq->methodCode][slot], (uint64_t)1);
+  stats->lastByte.record((nowMicros() - curReq->started) * 1000);
+  releaseFile(curReq);
+  if (!curReq->continues) {
+    curReq->conn->closing = 1;
+  }
+  requestPool.release(curReq);
+}
+
+void closeConnection(struct Connection *conn)
+{
+  if ((size_t)conn->socket < connectionTable.size()) {
+    connectionTable[conn->socket] = NULL;
+  }
+  timerWheel.disarm(conn);
+  connectionsOpen--;
+  bump(stats->open, (int64_t)-1);
+  if (conn->idle) {
+    conn->idle = 0;
+    idleConnections.remove(conn);
+    bump(stats->idle, (int64_t)-1);
+  }
+  if (conn->inflight > 0) {
+    // io_uring still holds operations on the socket and the file, so their descriptors stay open
+    // until the last one completes, which the shutdown makes happen right away
+    shutdown(conn->socket, SHUT_RDWR);
+    conn->dead = 1;
+    return;
+  }
+  releaseConnection(conn);
+}
+
+void releaseConnection(struct Connection *conn)
+{
+  if (conn->sending != NULL) {
+    releaseFile(conn->sending);
+    requestPool.release(conn->sending);
+    conn->sending = NULL;
+  }
+  while (!conn->parkedBufs.empty()) {
+    uring.recycleBuffer(conn->parkedBufs.front().bid);
+    uring.parked--;
+    conn->parkedBufs.pop_front();
+  }
+  close(conn->socket);
+  connectionPool.release(conn);
+}
+
+void reserveOutput(struct Connection *conn, size_t len)
+{
+  size_t need = conn->outstr.length() + len;
+  if (!conn->sendInFlight || (need <= conn->outstr.capacity())) {
+    return;
+  }
+  //pieces are offsets, so a copy serves them all the same, while the kernel keeps reading the old one
+  std::string grown;
+  grown.reserve(std::max(need, 2 * conn->outstr.capacity()));
+  grown.append(conn->outstr);
+  conn->retired.push_back(std::string());
+  conn->retired.back().swap(conn->outstr);
+  conn->outstr.swap(grown);
+}
+
+void queueOutput(struct Connection *conn, const char *bytes, size_t len)
+{
+  if (len == 0) return;
+  reserveOutput(conn, len);
+  struct OutPiece piece;
+  piece.start = conn->outstr.length();
+  piece.len = len;
+  conn->outstr.append(bytes, len);
+  conn->out.push_back(piece);
+}
+
+void queueBody(struct Connection *conn, std::shared_ptr<struct CachedFile> body, off_t start, off_t len)
+{
+  if (len <= 0) return;
+  struct OutPiece piece;
+  piece.body = body;
+  piece.start = start;
+  piece.len = len;
+  conn->out.push_back(piece);
+}
+
+/**
+ * The io_uring backend. The reactor loop and everything it calls are shared with epoll, only the
+ * way bytes get on and off the sockets differs: a multishot accept hands over new connections, a
+ * multishot receive per connection fills the lent buffers, and responses go out as one sendmsg of
+ * everything queued, or as a read of a piece of the file linked to the send of it
+ */
+int uringListener(int mainSock)
+{
+  if (uring.setup(URING_ENTRIES) == -1) {
+    return -1;
+  }
+  time_t lastTick = time(0);
+  refreshDate(lastTick);
+  while (true)
+    {
+      // idle keep-alives still make room for newcomers when the listener is paused
+      int sheddable = (connectionsOpen >= maxConnections) && (idleConnections.oldest() != NULL);
+      int paused = (overloadPolicy == OVERLOAD_PAUSE) && isOverloaded() && !sheddable;
+      if (!acceptArmed && !paused && (time(0) >= acceptBackoff)) {
+	struct io_uring_sqe *sqe = uring.getSqe();
+	if (sqe != NULL) {
+	  sqe->opcode = IORING_OP_ACCEPT;
+	  sqe->fd = mainSock;
+	  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	  sqe->accept_flags = SOCK_NONBLOCK;
+	  sqe->user_data = OP_ACCEPT;
+	  acceptArmed = 1;
+	}
+      } else if (acceptArmed && paused && !acceptCancelling) {
+	// the rest wait in the kernel's backlog until this worker has room again
+	struct io_uring_sqe *sqe = uring.getSqe();
+	if (sqe != NULL) {
+	  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	  sqe->addr = OP_ACCEPT;
+	  sqe->user_data = OP_CANCEL;
+	  acceptCancelling = 1;
+	}
+      }
+      if (!wakeArmed && (mailbox.fd != -1)) {
+	struct io_uring_sqe *sqe = uring.getSqe();
+	if (sqe != NULL) {
+	  sqe->opcode = IORING_OP_POLL_ADD;
+	  sqe->fd = mailbox.fd;
+	  sqe->len = IORING_POLL_ADD_MULTI;
+	  sqe->poll32_events = POLLIN;
+	  sqe->user_data = OP_WAKE;
+	  wakeArmed = 1;
+	}
+      }
+      // starved receives get another go once the kernel has buffers again
+      if (!starvedConnections.empty() && (uring.parked < URING_BUFFERS)) {
+	std::vector<struct Connection*> starved;
+	starved.swap(starvedConnections);
+	for (size_t i = 0; i < starved.size(); i++) {
+	  struct Connection *conn = starved[i];
+	  conn->inflight--;
+	  if (conn->dead) {
+	    if (conn->inflight == 0) releaseConnection(conn);
+	  } else {
+	    uringArmRecv(conn);
+	  }
+	}
+      }
+
+      // one system call submits everything queued and waits, never past the next tick
+      uring.submit(1, eventQueue.empty() ? TICK_INTERVAL : 0);
+      struct io_uring_cqe *cqe;
+      while ((cqe = uring.peekCqe()) != NULL) {
+	struct io_uring_cqe seen = *cqe;
+	uring.seenCqe();
+	uringCompletion(&seen, mainSock);
+      }
+      stats->queueDepth.store(requestPool.inUse(), std::memory_order_relaxed);
+      eventProcessor();
+      if (time(0) != lastTick) {
+	lastTick = time(0);
+	refreshDate(lastTick);
+	refreshIndex();
+	fdCache.expire(lastTick, FD_IDLE);
+	timerWheel.advance(lastTick, (getTimeout() + 999) / 1000);
+      }
+    }
+}
+
+void uringCompletion(struct io_uring_cqe *cqe, int mainSock)
+{
+  int op = cqe->user_data & OP_MASK;
+  int more = cqe->flags & IORING_CQE_F_MORE;
+  int res = cqe->res;
+  if (op == OP_CANCEL) {
+    return;
+  }
+  if (op == OP_WAKE) {
+    if (!more) {
+      wakeArmed = 0;
+    }
+    collectJobs();
+    return;
+  }
+  if (op == OP_ACCEPT) {
+    if (!more) {
+      acceptArmed = 0;
+      acceptCancelling = 0;
+    }
+    if (res < 0) {
+      if (res == -EMFILE || res == -ENFILE) {
+	// out of descriptors, the backlog is left alone for a second instead of spinning on it
+	acceptBackoff = time(0) + 1;
+      }
+      return;
+    }
+    if (isOverloaded() && !((connectionsOpen >= maxConnections) && shedIdleConnection())) {
+      // under the pause policy the accept is cancelled on the next pass, this one is already here
+      rejectConnection(res);
+    } else {
+      openConnection(res);
+    }
+    return;
+  }
+
+  struct Connection *conn = (struct Connection*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+  // the handler holds a reference of its own, so the connection outlives a close from within it
+  conn->inflight++;
+  if (!more) {
+    conn->inflight--;
+  }
+  if (op == OP_RECV) {
+    int bid = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    if (conn->dead) {
+      if (bid != -1) uring.recycleBuffer(bid);
+    } else if (res > 0) {
+      struct ParkedBuffer parked;
+      parked.bid = bid;
+      parked.start = 0;
+      parked.len = res;
+      conn->parkedBufs.push_back(parked);
+      uring.parked++;
+      conn->lastActive = time(0);
+      if (!more) uringArmRecv(conn);
+      uringServe(conn);
+    } else if (res == -ENOBUFS) {
+      // every buffer is parked on some connection, this one waits until they come back
+      conn->inflight++;
+      starvedConnections.push_back(conn);
+    } else {
+      // the client hung up (or the socket failed), whatever it sent completely is still answered
+      if (bid != -1) uring.recycleBuffer(bid);
+      conn->eof = 1;
+      uringServe(conn);
+    }
+  } else if (op == OP_SEND) {
+    conn->sendInFlight = 0;
+    if (!conn->dead) {
+      if (res < 0) {
+	//the client went away in the middle of a response
+	closeConnection(conn);
+      } else {
+	advanceOutput(conn, res);
+	uringServe(conn);
+      }
+    }
+  } else if (op == OP_FILE_READ) {
+    conn->chunkRead = res;
+  } else if (op == OP_FILE_SEND && !conn->dead) {
+    struct Request *curReq = conn->sending;
+    if ((res == -ECANCELED) && (conn->chunkRead > 0)) {
+      // the read came up short, which cancelled the send linked to it, so only what it got is sent
+      conn->chunkLen = conn->chunkRead;
+      res = 0;
+    } else if (res <= 0) {
+      // the file was truncated underneath us, or the client went away in the middle of the transfer
+      conn->sendInFlight = 0;
+      closeConnection(conn);
+      res = -1;
+    } else {
+      conn->chunkSent += res;
+      conn->lastActive = time(0);
+      bump(stats->bytesSent, (uint64_t)res);
+    }
+    if (res >= 0 && conn->chunkSent < conn->chunkLen) {
+      struct io_uring_sqe *sqe = uring.getSqe();
+      if (sqe == NULL) {
+	conn->sendInFlight = 0;
+	closeConnection(conn);
+      } else {
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = conn->socket;
+	sqe->addr = (uint64_t)(uintptr_t)(conn->chunk + conn->chunkSent);
+	sqe->len = conn->chunkLen - conn->chunkSent;
+	sqe->msg_flags = MSG_NOSIGNAL | ((curReq->filepos + (off_t)conn->chunkLen < curReq->filesize) ? MSG_MORE : 0);
+	sqe->user_data = (uint64_t)(uintptr_t)conn | OP_FILE_SEND;
+	conn->inflight++;
+      }
+    } else if (res >= 0) {
+      curReq->filepos += conn->chunkLen;
+      conn->sendInFlight = 0;
+      uringServe(conn);
+    }
+  }
+  conn->inflight--;
+  if (conn->dead && (conn->inflight == 0)) {
+    releaseConnection(conn);
+  }
+}
+
+void uringArmRecv(struct Connection *conn)
+{
+  struct io_uring_sqe *sqe = uring.getSqe();
+  if (sqe == NULL) {
+    closeConnection(conn);
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->socket;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = (uint64_t)(uintptr_t)conn | OP_RECV;
+  conn->inflight++;
+}
+
+// copies as much of the parked input as inbuf takes, growing and compacting it like readConnection
+static void drainParked(struct Connection *conn)
+{
+  struct ReadBuffer *in = &conn->inbuf;
+  while (!conn->parkedBufs.empty()) {
+    if (in->data == NULL) {
+      bufferPool.acquire(in, REQ_SIZ);
+    }
+    if (in->len == in->cap) {
+      if (conn->consumed > 0) {
+	in->len -= conn->consumed;
+	memmove(in->data, in->data + conn->consumed, in->len);
+	conn->consumed = 0;
+	conn->parser.restart(0);
+      } else if (!bufferPool.grow(in)) {
+	// the header has outgrown the largest buffer, serveConnection decides what that means
+	return;
+      }
+    }
+    struct ParkedBuffer &parked = conn->parkedBufs.front();
+    size_t n = std::min(parked.len, in->cap - in->len);
+    memcpy(in->data + in->len, uring.buffer(parked.bid) + parked.start, n);
+    in->len += n;
+    parked.start += n;
+    parked.len -= n;
+    if (parked.len == 0) {
+      uring.recycleBuffer(parked.bid);
+      uring.parked--;
+      conn->parkedBufs.pop_front();
+    }
+  }
+}
+
+void uringServe(struct Connection *conn)
+{
+  // a connection waiting on its own send takes in what arrives but answers nothing until it completes
+  while (!conn->dead && !conn->sendInFlight && (conn->job == NULL)) {
+    size_t pending = conn->parkedBufs.size();
+    drainParked(conn);
+    serveConnection(conn);
+    if (conn->parkedBufs.empty() || (conn->parkedBufs.size() == pending)) {
+      return;
+    }
+  }
+}
+
+int uringFlush(struct Connection *conn)
+{
+  if (conn->sendInFlight) {
+    return 0;
+  }
+  conn->retired.clear();
+  if (conn->outHead < conn->out.size()) {
+    // the queued pieces go out MAX_IOV at a time, the rest once this send completes
+    int n = 0;
+    for (size_t i = conn->outHead; (i < conn->out.size()) && (n < MAX_IOV); i++, n++) {
+      struct OutPiece &piece = conn->out[i];
+      const char *base = piece.body ? piece.body->data : conn->outstr.data();
+      conn->iov[n].iov_base = (void*)(base + piece.start);
+      conn->iov[n].iov_len = piece.len;
+    }
+    struct io_uring_sqe *sqe = uring.getSqe();
+    if (sqe == NULL) {
+      return -1;
+    }
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = n;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->socket;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | moreFlag(conn, conn->outHead + n);
+    sqe->user_data = (uint64_t)(uintptr_t)conn | OP_SEND;
+    conn->inflight++;
+    conn->sendInFlight = 1;
+    return 0;
+  }
+  conn->out.clear();
+  conn->outstr.clear();
+  conn->outHead = 0;
+
+  struct Request *curReq = conn->sending;
+  if (curReq == NULL) {
+    return 1;
+  }
+  if (curReq->filepos >= curReq->filesize) {
+    //we are done with the file, just check if we need to continue listening to the client
+    conn->sending = NULL;
+    finishRequest(curReq);
+    return 1;
+  }
+  // the next piece is read into the chunk and sent from it, the send linked to run after the read
+  if (conn->chunk == NULL) {
+    conn->chunk = (char*) malloc(URING_CHUNK_SIZ);
+  }
+  off_t left = curReq->filesize - curReq->filepos;
+  conn->chunkLen = (left < URING_CHUNK_SIZ) ? left : URING_CHUNK_SIZ;
+  conn->chunkSent = 0;
+  conn->chunkRead = -1;
+  struct io_uring_sqe *read = uring.getSqe(2);
+  if (read == NULL) {
+    return -1;
+  }
+  read->opcode = IORING_OP_READ;
+  read->fd = curReq->file;
+  read->addr = (uint64_t)(uintptr_t)conn->chunk;
+  read->len = conn->chunkLen;
+  read->off = curReq->filepos;
+  read->flags = IOSQE_IO_LINK;
+  read->user_data = (uint64_t)(uintptr_t)conn | OP_FILE_READ;
+  struct io_uring_sqe *send = uring.getSqe();
+  send->opcode = IORING_OP_SEND;
+  send->fd = conn->socket;
+  send->addr = (uint64_t)(uintptr_t)conn->chunk;
+  send->len = conn->chunkLen;
+  send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | ((left > (off_t)conn->chunkLen) ? MSG_MORE : 0);
+  send->user_data = (uint64_t)(uintptr_t)conn | OP_FILE_SEND;
+  conn->inflight += 2;
+  conn->sendInFlight = 1;
+  return 0;
+}
+
+int setNonBlocking(int sock)
+{
+  int flags = fcntl(sock, F_GETFL, 0);
+  if (flags == -1) return -1;
+  return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* ***************************************************************************************
+ * This is the main method, spawning all the necessary starting threads for server operation
+ *
+ */
+int main(int argc, char** argv)
+{
+  //rootDirectory = std::string("/home/cs-students/16amt4/cs339/server/files");
+  //rootDirectory = std::string("/home/cs-students/16dpg3/distSystems/workingserver/files");
+
+  std::string port;
+  int threads = 1;
+  const char *mimeTypesPath = NULL;
+  if (argc < 5) {
+    //not enough parameters passed in
+    std::cout << "Usage is -document_root <path> -port <int> [-threads <int>]"
+	      << " [-log_level off|error|info|debug] [-access_log <path>] [-access_log_format text|binary]"
+	      << " [-mime_types <path>] [-backlog <int>] [-max_connections <int>] [-queue_cap <int>]"
+	      << " [-accept_batch <int>] [-overload reject|pause] [-io_backend epoll|uring]"
+	      << " [-preload off|index|contents] [-blocking_threads <int>]\n";
+    return 0;;
+  } else { // if we got enough parameters...
+    for (int i = 1; i < argc; i++) { /* We will iterate over argv[] to get the parameters stored inside.
+				      * Note that we're starting on 1 because we don't need to know the 
+				      * path of the program, which is stored in argv[0] */
+      std::string current = std::string(argv[i]);
+      if (i + 1 != argc) // Check that we haven't finished parsing already
+	if (current.compare("-document_root") == 0) {
+	  // We know the next argument *should* be the filename:
+	  rootDirectory = std::string(argv[i + 1]);
+	} else if (current.compare("-port") == 0) {
+	  port = std::string(argv[i + 1]);
+	} else if (current.compare("-threads") == 0) {
+	  threads = atoi(argv[i + 1]);
+	  if (threads < 1) threads = 1;
+	} else if (current.compare("-log_level") == 0) {
+	  std::string level = std::string(argv[i + 1]);
+	  if (level.compare("off") == 0) logLevel = LOG_OFF;
+	  else if (level.compare("error") == 0) logLevel = LOG_ERROR;
+	  else if (level.compare("info") == 0) logLevel = LOG_INFO;
+	  else if (level.compare("debug") == 0) logLevel = LOG_DEBUG;
+	} else if (current.compare("-access_log") == 0) {
+	  accessLogFd = open(argv[i + 1], O_WRONLY | O_CREAT | O_APPEND, 0644);
+	  if (accessLogFd == -1) {
+	    std::cout << "Could not open access log " << argv[i + 1] << "\n";
+	    return 1;
+	  }
+	} else if (current.compare("-access_log_format") == 0) {
+	  accessLogBinary = (std::string(argv[i + 1]).compare("binary") == 0);
+	} else if (current.compare("-mime_types") == 0) {
+	  mimeTypesPath = argv[i + 1];
+	} else if (current.compare("-backlog") == 0) {
+	  listenBacklog = atoi(argv[i + 1]);
+	} else if (current.compare("-max_connections") == 0) {
+	  maxConnections = atoi(argv[i + 1]);
+	  if (maxConnections < 1) maxConnections = 1;
+	} else if (current.compare("-queue_cap") == 0) {
+	  queueCap = atoi(argv[i + 1]);
+	  if (queueCap < 1) queueCap = 1;
+	} else if (current.compare("-accept_batch") == 0) {
+	  acceptBatch = atoi(argv[i + 1]);
+	  if (acceptBatch < 1) acceptBatch = 1;
+	} else if (current.compare("-overload") == 0) {
+	  overloadPolicy = (std::string(argv[i + 1]).compare("pause") == 0) ? OVERLOAD_PAUSE : OVERLOAD_REJECT;
+	} else if (current.compare("-preload") == 0) {
+	  std::string mode = std::string(argv[i + 1]);
+	  preloadMode = (mode.compare("contents") == 0) ? PRELOAD_CONTENTS
+	    : (mode.compare("index") == 0) ? PRELOAD_INDEX : PRELOAD_OFF;
+	} else if (current.compare("-blocking_threads") == 0) {
+	  blockingThreads = atoi(argv[i + 1]);
+	  if (blockingThreads < 0) blockingThreads = 0;
+	} else if (current.compare("-io_backend") == 0) {
+	  ioBackend = (std::string(argv[i + 1]).compare("uring") == 0) ? IO_URING : IO_EPOLL;
+	} else {
+	  //std::cout << "Not enough or invalid arguments, please try again.\n";
+	}
+    }
+  }
+  
+  // the workers resolve every path beneath this descriptor, so the root is fixed from here on
+  rootFd = open(rootDirectory.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (rootFd == -1) {
+    std::cout << "Could not open the document root " << rootDirectory << "\n";
+    return 1;
+  }
+  if (loadMimeTypes(mimeTypesPath) == -1) {
+    std::cout << "Could not read mime types from " << mimeTypesPath << "\n";
+    return 1;
+  }
+  int iPort = atoi(port.c_str());
+  // a client hanging up mid-response must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+  if (preloadMode != PRELOAD_OFF) {
+    // SIGHUP is taken by the librarian alone, every thread started from here on inherits the mask
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+  }
+  // the scribe does all the writing for the log, so no worker ever waits on the terminal or disk
+  std::thread scribe(logWriter);
+  scribe.detach();
+  if (preloadMode != PRELOAD_OFF) {
+    // the first index is in place before any worker answers a request
+    docIndex = DocIndex::build(preloadMode == PRELOAD_CONTENTS);
+    indexGeneration++;
+    std::thread librarian(indexRebuilder);
+    librarian.detach();
+  }
+  // the porters take the lookups and reads that may wait on the disk off the workers, none means inline
+  if (blockingThreads > 0) {
+    blockingPool.start(blockingThreads);
+  }
+  // one navi per worker, each with its own listener, reactor and event queue
+  std::vector<std::thread> navis;
+  for (int i = 0; i < threads; i++) {
+    navis.push_back(std::thread(mainListener, iPort));
+  }
+  for (int i = 0; i < threads; i++) {
+    navis[i].join();
+  }
+  exit(0);
+}
+
+/**
+ * This method is dispatched called within a detatches thread and handles requests
+ */
+void handleRequest(struct Request *curReq) {
+  //if the parser accepted the request... 
+  if (curReq->parser.state == P_DONE) {
+    const char *buf = curReq->conn->inbuf.data;
+    // gets the string for method
+    curReq->method.assign(buf + curReq->parser.method.start, curReq->parser.method.len);
+    curReq->methodCode = sliceEquals(buf, curReq->parser.method, "GET") ? METHOD_GET
+      : sliceEquals(buf, curReq->parser.method, "HEAD") ? METHOD_HEAD
+      : sliceEquals(buf, curReq->parser.method, "OPTIONS") ? METHOD_OPTIONS : METHOD_OTHER;
+    //sets the requestURI
+    curReq->requestURI.assign(buf + curReq->parser.uri.start, curReq->parser.uri.len);
+    //sets default path of '/' to '/index.html'
+    if (curReq->requestURI.compare("/") == 0) {
+      curReq->requestURI = "/index.html";
+    }
+    
+    //only 1.0 and 1.1 are spoken, and the answer names one of them whatever the client sent
+    const char *version = buf + curReq->parser.version.start;
+    int supported = (memcmp(version, "HTTP/1.", 7) == 0) && ((version[7] == '0') || (version[7] == '1'));
+    curReq->version = (supported && (version[7] == '0')) ? "HTTP/1.0" : "HTTP/1.1";
+    logMessage(LOG_DEBUG, "method: \"%s\" requestURI: \"%s\" version: \"%.8s\"",
+	       curReq->method.c_str(), curReq->requestURI.c_str(), version);
+    if (!supported) {
+      respondWithError(curReq, "505 HTTP Version Not Supported");
+      return;
+    }
+    
+    curReq->continues = curReq->framed && doesListenMore(curReq);
+
+    //if we are doing an options call
+    if (curReq->methodCode == METHOD_OPTIONS) {
+      respondToOPTIONS(curReq);
+      return;
+    }
+
+    //hot files are answered straight from memory, without a stat or an open
+    int isGET = (curReq->methodCode == METHOD_GET);
+    int isHEAD = (curReq->methodCode == METHOD_HEAD);
+
+    //the reserved stats URI is answered by the server itself, never from the document root
+    if ((isGET || isHEAD) && (curReq->requestURI.compare(0, sizeof(STATS_URI) - 1, STATS_URI) == 0)
+	&& ((curReq->requestURI.length() == sizeof(STATS_URI) - 1)
+	    || (curReq->requestURI[sizeof(STATS_URI) - 1] == '?'))) {
+      respondToStats(curReq);
+      return;
+    }
+
+    //a query or a different spelling of the same path must not make another copy of the file
+    if (uriToPath(curReq->requestURI, &curReq->path) == -1) {
+      logMessage(LOG_DEBUG, "%s does not decode to a path", curReq->requestURI.c_str());
+      respondWithError(curReq, "400 Bad Request");
+      return;
+    }
+    if (curReq->path == ".") {
+      curReq->path = "index.html";
+    }
+
+    if ((isGET || isHEAD) && workerIndex && respondFromIndex(curReq)) {
+      return;
+    }
+
+    //a file kept in memory was read lately, so the stat that revalidates it hardly ever waits on the disk
+    if (isGET || isHEAD) {
+      curReq->cached = fileCache.lookup(curReq->path);
+      if (curReq->cached) {
+	bump(stats->cacheHits, (uint64_t)1);
+	curReq->fullsize = curReq->filesize = curReq->cached->size;
+	curReq->mtime = curReq->cached->mtime;
+	if (isNotModified(curReq)) {
+	  respondNotModified(curReq);
+	} else {
+	  respondToFile(curReq);
+	}
+	return;
+      }
+    }
+
+    //a path the worker has not looked up lately may take the disk to resolve, the porters do that
+    if (deferRequest(curReq)) {
+      return;
+    }
+    if (isGET || isHEAD) {
+      bump(stats->cacheMisses, (uint64_t)1);
+    }
+
+    struct stat s;
+    int resolved = pathCache.resolve(curReq->path, &s, &curReq->file);
+    if (resolved == 200) {
+      //a client that already has the file is answered from the stat alone
+      if (isGET || isHEAD) {
+	curReq->fullsize = s.st_size;
+	curReq->mtime = s.st_mtime;
+	if (isNotModified(curReq)) {
+	  releaseFile(curReq);
+	  respondNotModified(curReq);
+	  return;
+	}
+      }
+      //file was opened appropriately
+      if (openFile(curReq, &s) != -1) {
+	curReq->fullsize = curReq->filesize = s.st_size;
+	curReq->mtime = s.st_mtime;
+	//small files are kept so the next request for them never reaches the disk
+	if ((isGET || isHEAD) && !curReq->opened
+	    && (curReq->cached = fileCache.insert(curReq->path, curReq->file))) {
+	  releaseFile(curReq);
+	  curReq->fullsize = curReq->filesize = curReq->cached->size;
+	  curReq->mtime = curReq->cached->mtime;
+	}
+	if (isGET || isHEAD) {
+	  respondToFile(curReq);
+	} else {
+	  //method requested hasn't been implemented
+	  std::string errorStr = std::string("501 Not Implemented");
+	  respondWithError(curReq, errorStr);
+	}	
+	//A server SHOULD return the status code 405 (Method Not Allowed) if the method is known 
+	//by the orgin server but not allowed for the requested resource. 
+      } else {
+	logMessage(LOG_INFO, "error opening %s: %s", curReq->requestURI.c_str(), strerror(errno));
+	respondWithError(curReq, "404 File Not Found");
+      }
+    } else {
+      logMessage(LOG_DEBUG, "%s did not resolve to a readable file", curReq->requestURI.c_str());
+      //client was trying to do something that was dissallowed, or asked for something not there
+      respondWithError(curReq, resolveStatus(resolved));
+    }
+  } else {
+    logMessage(LOG_DEBUG, "failed to parse request");
+    curReq->version = "HTTP/1.0";
+    respondWithError(curReq, "400 Bad Request");
+  }
+}
+
+//queues the header and the body, a body that has to come from the file is streamed once all before it is sent
+int respondToGET(struct Request* curReq)
+{
+  if (queueHeader(curReq, (curReq->status == 206) ? "206 Partial Content" : "200 OK", NULL, NULL, 0) == -1) {
+    finishRequest(curReq);
+  } else if (curReq->cached) {
+    //the body is already in memory, so it is written straight from the cache entry
+    queueBody(curReq->conn, curReq->cached, curReq->filepos, curReq->filesize - curReq->filepos);
+    finishRequest(curReq);
+  } else {
+    curReq->conn->sending = curReq;
+  }
+  return 0;
+}
+
+int respondToHEAD(struct Request *curReq)
+{
+  // just sends the header for the requested response
+  logMessage(LOG_DEBUG, "processing a request for HEAD");
+  queueHeader(curReq, (curReq->status == 206) ? "206 Partial Content" : "200 OK", NULL, NULL, 0);
+
+  finishRequest(curReq);
+  return 0;
+}
+
+int respondToOPTIONS(struct Request *curReq)
+{
+  logMessage(LOG_DEBUG, "responding to OPTIONS");
+  static const char allow[] =
+    "Access-Control-Allow-Methods: GET,HEAD,OPTIONS\r\n"
+    "Allow: GET,HEAD,OPTIONS\r\n"
+    "Public: GET,HEAD,OPTIONS\r\n";
+  curReq->status = 200;
+  //the allowed methods are header lines, so there is no body at all
+  curReq->filesize = 0;
+  queueHeader(curReq, "200 OK", "", allow, sizeof(allow) - 1);
+  
+  finishRequest(curReq);
+  return 0;
+}
+
+//the descriptor the path was just resolved with, if there is one, is used or handed to the cache
+int openFile(struct Request *curReq, struct stat *s)
+{
+  int isGET = (curReq->methodCode == METHOD_GET);
+  int isHEAD = (curReq->methodCode == METHOD_HEAD);
+  if ((isGET || isHEAD) && (s->st_size > CACHE_FILE_SIZ)) {
+    //a popular large file is sent from one descriptor however many clients fetch it
+    curReq->opened = fdCache.acquire(curReq->path, s, curReq->file);
+    curReq->file = curReq->opened ? curReq->opened->fd : -1;
+  } else if (curReq->file == -1) {
+    curReq->file = pathCache.open(curReq->path, s);
+  }
+  return curReq->file;
+}
+
+void releaseFile(struct Request *curReq)
+{
+  if (curReq->opened != NULL) {
+    fdCache.release(curReq->opened);
+  } else if (curReq->file != -1) {
+    close(curReq->file);
+  }
+  curReq->opened = NULL;
+  curReq->file = -1;
+}
+
+int respondFromIndex(struct Request *curReq)
+{
+  const IndexEntry *hit = workerIndex->find(curReq->path);
+  if (hit == NULL) {
+    //the index is the document root as of the last SIGHUP, so a path it lacks is not there without asking the disk
+    respondWithError(curReq, "404 Not Found");
+    return 1;
+  }
+  if (hit->file == NULL) {
+    //a file left on disk is opened, cached and compressed the usual way, so its validators match its body
+    return 0;
+  }
+  //the body shares ownership of the whole index, so a rebuild never frees it in the middle of a send
+  curReq->cached = std::shared_ptr<CachedFile>(workerIndex, hit->file);
+  bump(stats->cacheHits, (uint64_t)1);
+  curReq->fullsize = curReq->filesize = curReq->cached->size;
+  curReq->mtime = curReq->cached->mtime;
+  if (isNotModified(curReq)) {
+    respondNotModified(curReq);
+    return 1;
+  }
+  respondToFile(curReq);
+  return 1;
+}
+
+void respondToFile(struct Request *curReq)
+{
+  curReq->status = 200;
+  //a range is always taken from the file as it is, so only whole bodies are compressed
+  int range = selectRange(curReq);
+  if (range == -1) {
+    releaseFile(curReq);
+    respondWithError(curReq, "416 Range Not Satisfiable");
+    return;
+  }
+  if ((range == 0) && negotiateEncoding(curReq)) {
+    return;
+  }
+  respondWithBody(curReq);
+}
+
+void respondWithBody(struct Request *curReq)
+{
+  if (curReq->methodCode == METHOD_GET) {
+    respondToGET(curReq);
+  } else {
+    respondToHEAD(curReq);
+  }
+}
+
+void respondNotModified(struct Request *curReq)
+{
+  logMessage(LOG_DEBUG, "responding with not modified");
+  curReq->status = 304;
+  curReq->filepos = curReq->filesize = 0;
+  //the 304 stands in for a 200, so it carries the ETag of the body this client would have been sent
+  curReq->encoding = expectedEncoding(curReq);
+  queueHeader(curReq, "304 Not Modified", NULL, NULL, 0);
+  finishRequest(curReq);
+}
+
+int respondToStats(struct Request *curReq)
+{
+  static const char nostore[] = "Cache-Control: no-store\r\n";
+  int prometheus = (curReq->requestURI.find("format=prometheus") != std::string::npos);
+  std::string body = renderStats(prometheus);
+  curReq->status = 200;
+  curReq->filesize = body.length();
+  if ((queueHeader(curReq, "200 OK", prometheus ? "text/plain; version=0.0.4" : "text/plain",
+		   nostore, sizeof(nostore) - 1) == 0) && (curReq->methodCode == METHOD_GET)) {
+    queueOutput(curReq->conn, body.data(), body.length());
+  }
+  finishRequest(curReq);
+  return 0;
+}
+
+int respondWithError(struct Request *curReq, std::string error)
+{
+  // sends the error passed in
+  logMessage(LOG_DEBUG, "responding with an error");
+  curReq->status = atoi(error.c_str());
+  //adds a simple body for the browser to display
+  char errorbody[128];
+  int bodylen = snprintf(errorbody, sizeof(errorbody), "<html>\n%s\n</html>\n", error.c_str());
+  if (bodylen >= (int)sizeof(errorbody)) bodylen = sizeof(errorbody) - 1;
+  curReq->filepos = 0;
+  curReq->filesize = bodylen;
+  if (queueHeader(curReq, error.c_str(), "text/html", NULL, 0) == 0) {
+    queueOutput(curReq->conn, errorbody, bodylen);
+  }
+  finishRequest(curReq);
+  return 0;
+}
+
+// copies src into buf at pos, returning the new position, or one past cap once anything did not fit
+static size_t appendBytes(char *buf, size_t cap, size_t pos, const char *src, size_t len)
+{
+  if ((pos > cap) || (len > cap - pos)) {
+    return cap + 1;
+  }
+  memcpy(buf + pos, src, len);
+  return pos + len;
+}
+
+size_t buildHeader(struct Request *curReq, const char *status, const char *type,
+		   const char *extra, size_t extralen, char *buf, size_t cap)
+{
+  size_t pos = 0;
+  pos = appendBytes(buf, cap, pos, curReq->version.data(), curReq->version.length());
+  pos = appendBytes(buf, cap, pos, " ", 1);
+  pos = appendBytes(buf, cap, pos, status, strlen(status));
+  pos = appendBytes(buf, cap, pos, "\r\n", 2);
+  pos = appendBytes(buf, cap, pos, serverLine, sizeof(serverLine) - 1);
+  pos = appendBytes(buf, cap, pos, dateLine, dateLineLen);
+  int weak = (curReq->encoding != ENCODING_IDENTITY);
+  char validators[256];
+  if (curReq->status == 304) {
+    //a 304 only repeats the validators and the Vary of the 200, it has no body to describe
+    if (isCompressible(contentTypeForFile(curReq->path))) {
+      pos = appendBytes(buf, cap, pos, "Vary: Accept-Encoding\r\n", 23);
+    }
+    pos = appendBytes(buf, cap, pos, validators,
+		      formatValidators(validators, sizeof(validators), curReq->mtime, curReq->fullsize, weak));
+  } else if (curReq->cached && (type == NULL) && (curReq->status == 200)) {
+    //a cached file carries its Content-Type, validators and Content-Length lines ready made
+    pos = appendBytes(buf, cap, pos, curReq->cached->fields.data(), curReq->cached->fields.length());
+  } else {
+    if (type == NULL) {
+      type = contentTypeForFile(curReq->path);
+    }
+    if (*type != '\0') {
+      pos = appendBytes(buf, cap, pos, "Content-Type: ", 14);
+      pos = appendBytes(buf, cap, pos, type, strlen(type));
+      pos = appendBytes(buf, cap, pos, "\r\n", 2);
+    }
+    if (curReq->encoding == ENCODING_GZIP) {
+      pos = appendBytes(buf, cap, pos, "Content-Encoding: gzip\r\n", 24);
+    }
+    char digits[24];
+    if ((curReq->status == 200) || (curReq->status == 206)) {
+      //responses for a file carry its validators, and say that its encoding was negotiated
+      if (curReq->mtime != 0) {
+	if (isCompressible(type)) {
+	  pos = appendBytes(buf, cap, pos, "Vary: Accept-Encoding\r\n", 23);
+	}
+	pos = appendBytes(buf, cap, pos, validators,
+			  formatValidators(validators, sizeof(validators), curReq->mtime, curReq->fullsize, weak));
+      }
+    }
+    if ((curReq->status == 206) || (curReq->status == 416)) {
+      pos = appendBytes(buf, cap, pos, "Content-Range: bytes ", 21);
+      if (curReq->status == 206) {
+	pos = appendBytes(buf, cap, pos, digits, formatNumber(digits, curReq->filepos));
+	pos = appendBytes(buf, cap, pos, "-", 1);
+	pos = appendBytes(buf, cap, pos, digits, formatNumber(digits, curReq->filesize - 1));
+      } else {
+	pos = appendBytes(buf, cap, pos, "*", 1);
+      }
+      pos = appendBytes(buf, cap, pos, "/", 1);
+      pos = appendBytes(buf, cap, pos, digits, formatNumber(digits, curReq->fullsize));
+      pos = appendBytes(buf, cap, pos, "\r\n", 2);
+    }
+    pos = appendBytes(buf, cap, pos, "Content-Length: ", 16);
+    pos = appendBytes(buf, cap, pos, digits, formatNumber(digits, curReq->filesize - curReq->filepos));
+    pos = appendBytes(buf, cap, pos, "\r\n", 2);
+  }
+  if (!curReq->continues && (curReq->version.compare("HTTP/1.1") == 0)) {
+    //a 1.1 client would otherwise expect the connection to stay open
+    pos = appendBytes(buf, cap, pos, "Connection: close\r\n", 19);
+  } else if (curReq->continues && (curReq->version.compare("HTTP/1.0") == 0)) {
+    //and a 1.0 client that asked for keep-alive that it will be closed
+    pos = appendBytes(buf, cap, pos, "Connection: keep-alive\r\n", 24);
+  }
+  // other headers that we want to support are passed in as extra lines
+  pos = appendBytes(buf, cap, pos, extra, extralen);
+  pos = appendBytes(buf, cap, pos, "\r\n", 2);
+  return (pos > cap) ? 0 : pos;
+}
+
+int queueHeader(struct Request *curReq, const char *status, const char *type,
+		const char *extra, size_t extralen)
+{
+  //the header is built in place at the end of the connection's output, which keeps its capacity
+  struct Connection *conn = curReq->conn;
+  curReq->bodylen = curReq->filesize - curReq->filepos;
+  size_t start = conn->outstr.length();
+  //the lines that can be any length are counted, so only a bug can make the header not fit
+  size_t cap = MAX_HEADER_SIZ + strlen(status) + extralen
+    + strlen((type != NULL) ? type : contentTypeForFile(curReq->path))
+    + (curReq->cached ? curReq->cached->fields.length() : 0);
+  reserveOutput(conn, cap);
+  conn->outstr.resize(start + cap);
+  long long buildStart = nowNanos();
+  size_t len = buildHeader(curReq, status, type, extra, extralen, &conn->outstr[start], cap);
+  stats->header.record(nowNanos() - buildStart);
+  int built = (len != 0);
+  if (!built) {
+    //a header that would go out cut short is never sent, the client is told and the connection ends
+    static const char failed[] = " 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    logMessage(LOG_ERROR, "the header for %s does not fit in %zu bytes", curReq->requestURI.c_str(), cap);
+    conn->outstr.replace(start, std::string::npos, curReq->version);
+    conn->outstr.append(failed, sizeof(failed) - 1);
+    len = conn->outstr.length() - start;
+    curReq->status = 500;
+    curReq->bodylen = 0;
+    curReq->continues = 0;
+  }
+  conn->outstr.resize(start + len);
+  struct OutPiece piece;
+  piece.start = start;
+  piece.len = len;
+  conn->out.push_back(piece);
+  logMessage(LOG_DEBUG, "%.*s", (int)len, conn->outstr.data() + start);
+  return built ? 0 : -1;
+}
+
+//whether the comma separated list in the header value holds token, in any case
+static int hasToken(const char *p, size_t len, const char *token)
+{
+  const char *end = p + len;
+  size_t tokenlen = strlen(token);
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *name = p;
+    while (p < end && *p != ',') p++;
+    const char *nameEnd = p;
+    while (nameEnd > name && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t')) nameEnd--;
+    if (((size_t)(nameEnd - name) == tokenlen) && (strncasecmp(name, token, tokenlen) == 0)) return 1;
+  }
+  return 0;
+}
+
+int doesListenMore(Request *curReq)
+{
+  //1.1 keeps the connection and 1.0 closes it, unless the client's Connection header says otherwise
+  int keep = (curReq->version.compare("HTTP/1.1") == 0);
+  struct Slice header;
+  const char *buf = curReq->conn->inbuf.data;
+  if (findHeader(&curReq->parser, buf, "Connection", &header)) {
+    if (hasToken(buf + header.start, header.len, "close")) {
+      keep = 0;
+    } else if (hasToken(buf + header.start, header.len, "keep-alive")) {
+      keep = 1;
+    }
+  }
+  if (keep) {
+    logMessage(LOG_DEBUG, "-> should continue to listen on this socket");
+    return 1;
+  } else {
+    shutdown(curReq->socket,SHUT_RD);
+    logMessage(LOG_DEBUG, "XX socket is being closed");
+    return 0;
+  }
+}
+
+// orders extensions without regard to case
+static bool mimeBefore(const MimeType &a, const MimeType &b)
+{
+  return strcasecmp(a.ext, b.ext) < 0;
+}
+
+static bool mimeSame(const MimeType &a, const MimeType &b)
+{
+  return strcasecmp(a.ext, b.ext) == 0;
+}
+
+const char *contentTypeForFile(const std::string &filename)
+{
+  //only the last extension of the last path segment counts, so /v1.2/app.js is javascript
+  const char *name = filename.c_str();
+  const char *dot = strrchr(name, '.');
+  if ((dot == NULL) || (strchr(dot, '/') != NULL) || (dot[1] == '\0')) {
+    return "";
+  }
+  const char *ext = dot + 1;
+  size_t low = 0, high = mimeTypes.size();
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    int order = strcasecmp(ext, mimeTypes[mid].ext);
+    if (order == 0) {
+      return mimeTypes[mid].type;
+    } else if (order < 0) {
+      high = mid;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return "";
+}
+
+int isCompressible(const char *type)
+{
+  //images, audio, video, fonts and archives are compressed already
+  return (strncmp(type, "text/", 5) == 0) || (strcmp(type, "application/json") == 0)
+    || (strcmp(type, "application/ld+json") == 0) || (strcmp(type, "application/manifest+json") == 0)
+    || (strcmp(type, "application/xml") == 0) || (strcmp(type, "application/xhtml+xml") == 0)
+    || (strcmp(type, "application/rss+xml") == 0) || (strcmp(type, "image/svg+xml") == 0)
+    || (strcmp(type, "application/wasm") == 0);
+}
+
+int acceptedEncodings(struct Request *curReq)
+{
+  struct Slice header;
+  const char *buf = curReq->conn->inbuf.data;
+  if (!findHeader(&curReq->parser, buf, "Accept-Encoding", &header)) {
+    return 0;
+  }
+  int accepted = 0;
+  const char *p = buf + header.start;
+  const char *end = p + header.len;
+  //every element is a coding, optionally followed by ;q=, and a weight of zero turns it down
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *name = p;
+    while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+    size_t namelen = p - name;
+    int refused = 0;
+    while (p < end && *p != ',') {
+      if ((*p == 'q' || *p == 'Q') && (p + 1 < end) && (p[1] == '=')) {
+	const char *q = p + 2;
+	refused = (q < end) && (*q == '0');
+	for (q++; refused && q < end && *q != ',' && *q != ';' && *q != ' '; q++) {
+	  if (*q != '.' && *q != '0') refused = 0;
+	}
+      }
+      p++;
+    }
+    if (refused || namelen == 0) continue;
+    if ((namelen == 4 && strncasecmp(name, "gzip", 4) == 0) || (namelen == 1 && *name == '*')) {
+      accepted |= 1 << ENCODING_GZIP;
+    }
+    if ((namelen == 7 && strncasecmp(name, "deflate", 7) == 0) || (namelen == 1 && *name == '*')) {
+      accepted |= 1 << ENCODING_DEFLATE;
+    }
+  }
+  return accepted;
+}
+
+//opens the .gz sibling of path for streaming if it is readable and at least as new as the file itself
+static int openSibling(const std::string &path, int file, off_t *size)
+{
+  int sibling = openBeneath((path + ".gz").c_str(), O_RDONLY | O_NONBLOCK);
+  if (sibling == -1) {
+    return -1;
+  }
+  struct stat s, original;
+  if ((fstat(sibling, &s) == 0) && (fstat(file, &original) == 0) && S_ISREG(s.st_mode)
+      && (S_IROTH & s.st_mode) && (s.st_mtime >= original.st_mtime)
+      && (fcntl(sibling, F_SETFL, 0) == 0)) {
+    *size = s.st_size;
+    return sibling;
+  }
+  close(sibling);
+  return -1;
+}
+
+//makes the request send the variant instead of the cached body
+static void useVariant(struct Request *curReq, std::shared_ptr<CachedFile> variant, int encoding)
+{
+  curReq->cached = variant;
+  curReq->filesize = variant->size;
+  curReq->encoding = encoding;
+}
+
+//makes the request stream the .gz sibling instead of the file
+static void useSibling(struct Request *curReq, int sibling, off_t size)
+{
+  releaseFile(curReq);
+  curReq->file = sibling;
+  curReq->filesize = size;
+  curReq->encoding = ENCODING_GZIP;
+}
+
+int negotiateEncoding(struct Request *curReq)
+{
+  if (!isCompressible(contentTypeForFile(curReq->path))) {
+    return 0;
+  }
+  int accepted = acceptedEncodings(curReq);
+  if (accepted == 0) {
+    return 0;
+  }
+  if (curReq->cached) {
+    //gzip is preferred, it is what precompressed siblings are stored as
+    for (int encoding = ENCODING_GZIP; encoding <= ENCODING_DEFLATE; encoding++) {
+      if (!(accepted & (1 << encoding))) continue;
+      //while a porter makes the variant, the requests that come meanwhile get the body as it is
+      if (curReq->cached->encodedPending & (1 << encoding)) {
+	return 0;
+      }
+      if (!(curReq->cached->encodedTried & (1 << encoding)) && deferEncode(curReq, encoding)) {
+	return 1;
+      }
+      std::shared_ptr<CachedFile> variant = fileCache.encode(curReq->cached, encoding);
+      if (variant) {
+	useVariant(curReq, variant, encoding);
+	return 0;
+      }
+    }
+  } else if ((curReq->file != -1) && (accepted & (1 << ENCODING_GZIP))) {
+    //files too big for the cache are never compressed here, but a .gz sibling is streamed instead
+    if (deferEncode(curReq, ENCODING_GZIP)) {
+      return 1;
+    }
+    off_t size;
+    int sibling = openSibling(curReq->path, curReq->file, &size);
+    if (sibling != -1) {
+      useSibling(curReq, sibling, size);
+    }
+  }
+  return 0;
+}
+
+int expectedEncoding(struct Request *curReq)
+{
+  if (!isCompressible(contentTypeForFile(curReq->path))) {
+    return ENCODING_IDENTITY;
+  }
+  int accepted = acceptedEncodings(curReq);
+  for (int encoding = ENCODING_GZIP; encoding <= ENCODING_DEFLATE; encoding++) {
+    if (!(accepted & (1 << encoding))) continue;
+    if (curReq->cached) {
+      //a variant that was tried and did not shrink the body is skipped, as negotiateEncoding does
+      if ((curReq->cached->encodedTried & (1 << encoding)) && !curReq->cached->encoded[encoding]) continue;
+      return encoding;
+    }
+    if (encoding != ENCODING_GZIP) break;
+    //a file too big for the cache is only sent compressed from a .gz sibling, which is assumed to be
+    //there unless the path cache already knows otherwise, since looking it up here may block
+    std::string sibling = curReq->path + ".gz";
+    struct stat s;
+    if (pathCache.fresh(sibling)
+	&& ((pathCache.resolve(sibling, &s, NULL) != 200) || (s.st_mtime < curReq->mtime))) {
+      break;
+    }
+    return encoding;
+  }
+  return ENCODING_IDENTITY;
+}
+
+int loadMimeTypes(const char *path)
+{
+  std::vector<MimeType> table;
+  if (path != NULL) {
+    //lines are a type followed by its extensions, as in /etc/mime.types, and # starts a comment
+    FILE *config = fopen(path, "r");
+    if (config == NULL) {
+      return -1;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), config) != NULL) {
+      char *comment = strchr(line, '#');
+      if (comment != NULL) *comment = '\0';
+      char *save;
+      char *type = strtok_r(line, " \t\r\n", &save);
+      if (type == NULL) continue;
+      type = strdup(type);
+      char *ext;
+      while ((ext = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+	if (*ext == '.') ext++;
+	MimeType entry = { strdup(ext), type };
+	table.push_back(entry);
+      }
+    }
+    fclose(config);
+  }
+  //the config file comes first, so its types win over the built-in ones for the same extension
+  table.insert(table.end(), builtinMimeTypes,
+	       builtinMimeTypes + sizeof(builtinMimeTypes) / sizeof(builtinMimeTypes[0]));
+  std::stable_sort(table.begin(), table.end(), mimeBefore);
+  table.erase(std::unique(table.begin(), table.end(), mimeSame), table.end());
+  mimeTypes.swap(table);
+  return 0;
+}
+
+//Returns the appropriate amount of time before the timeout would occur.
+int getTimeout(){
+  //The fuller the server, by connections or by memory, the smaller the timeout
+  double load = (double)connectionsOpen / BUSY_CONNECTIONS;
+  double memory = (double)residentMemory() / BUSY_MEMORY;
+  if (memory > load) load = memory;
+  if (load > 1) load = 1;
+  if (load < 0) load = 0;
+  int timeout = TIMEOUT - (int)((TIMEOUT - MIN_TIMEOUT) * load);
+  return timeout;
+}
+
+long residentMemory()
+{
+  long pages = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) return 0;
+  if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(statm);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+TimerWheel::TimerWheel(): current(time(0)), timeout((TIMEOUT + 999) / 1000)
+{
+  for (int i = 0; i < WHEEL_SLOTS; i++) slots[i] = NULL;
+}
+
+void TimerWheel::arm(struct Connection *conn)
+{
+  time_t deadline = conn->lastActive + timeout;
+  // anything already due is looked at on the next tick
+  if (deadline <= current) deadline = current + 1;
+  int slot = deadline % WHEEL_SLOTS;
+  conn->wheelSlot = slot;
+  conn->wheelPrev = NULL;
+  conn->wheelNext = slots[slot];
+  if (slots[slot] != NULL) slots[slot]->wheelPrev = conn;
+  slots[slot] = conn;
+}
+
+void TimerWheel::disarm(struct Connection *conn)
+{
+  if (conn->wheelSlot == -1) return;
+  if (conn->wheelPrev != NULL) conn->wheelPrev->wheelNext = conn->wheelNext;
+  else slots[conn->wheelSlot] = conn->wheelNext;
+  if (conn->wheelNext != NULL) conn->wheelNext->wheelPrev = conn->wheelPrev;
+  conn->wheelSlot = -1;
+  conn->wheelPrev = NULL;
+  conn->wheelNext = NULL;
+}
+
+int TimerWheel::advance(time_t now, time_t newTimeout)
+{
+  int expired = 0;
+  time_t oldTimeout = timeout;
+  timeout = newTimeout;
+  // a clock that jumped further than the wheel goes round it once
+  if (now - current > WHEEL_SLOTS) current = now - WHEEL_SLOTS;
+  while (current < now) {
+    current++;
+    expired += visit(current % WHEEL_SLOTS, now);
+  }
+  // connections scheduled further out than the new timeout reaches are brought forward right away
+  for (time_t t = now + newTimeout + 1; t <= now + oldTimeout; t++) {
+    expired += visit(t % WHEEL_SLOTS, now);
+  }
+  return expired;
+}
+
+int TimerWheel::visit(int slot, time_t now)
+{
+  int expired = 0;
+  struct Connection *conn = slots[slot];
+  slots[slot] = NULL;
+  while (conn != NULL) {
+    struct Connection *next = conn->wheelNext;
+    conn->wheelSlot = -1;
+    conn->wheelPrev = NULL;
+    conn->wheelNext = NULL;
+    // a connection that neither sent nor took any data for the whole timeout is closed, whether
+    // it is idle between requests, stuck halfway through one, or not reading its response
+    if (!conn->queued && (conn->job == NULL) && (now - conn->lastActive >= timeout)) {
+      logMessage(LOG_DEBUG, "timed out connection on socket: %d", conn->socket);
+      closeConnection(conn);
+      expired++;
+    } else {
+      arm(conn);
+    }
+    conn = next;
+  }
+  return expired;
+}
+
+std::shared_ptr<CachedFile> FileCache::lookup(const std::string &path)
+{
+  std::unordered_map<std::string, LRUList::iterator>::iterator found = index.find(path);
+  if (found == index.end()) {
+    return std::shared_ptr<CachedFile>();
+  }
+  LRUList::iterator entry = found->second;
+  time_t now = time(0);
+  //the path cache is consulted at most once a second per entry, and goes to the disk at most once per
+  //PATH_TTL, to notice files that changed
+  if ((*entry)->checked != now) {
+    struct stat s;
+    if ((pathCache.resolve(path, &s, NULL) != 200)
+	|| (s.st_mtime != (*entry)->mtime) || (s.st_size != (*entry)->size)) {
+      evict(entry);
+      return std::shared_ptr<CachedFile>();
+    }
+    (*entry)->checked = now;
+  }
+  lru.splice(lru.begin(), lru, entry);
+  return *entry;
+}
+
+//renders the Content-Type, Vary, validator and Content-Length lines of an entry once and for all
+static void renderFields(CachedFile *entry)
+{
+  entry->fields.clear();
+  if (*entry->contentType != '\0') {
+    entry->fields = std::string("Content-Type: ") + entry->contentType + "\r\n";
+  }
+  if (isCompressible(entry->contentType)) {
+    entry->fields += "Vary: Accept-Encoding\r\n";
+  }
+  char validators[256];
+  entry->fields.append(validators, formatValidators(validators, sizeof(validators), entry->mtime, entry->size, 0));
+  char digits[24];
+  entry->fields += "Content-Length: ";
+  entry->fields.append(digits, formatNumber(digits, entry->size));
+  entry->fields += "\r\n";
+}
+
+std::shared_ptr<CachedFile> FileCache::insert(const std::string &path, int file)
+{
+  struct stat s;
+  if ((fstat(file, &s) != 0) || (s.st_size > CACHE_FILE_SIZ) || ((size_t)s.st_size > capacity)) {
+    return std::shared_ptr<CachedFile>();
+  }
+  std::shared_ptr<CachedFile> entry(new CachedFile());
+  entry->path = path;
+  entry->body.resize(s.st_size);
+  off_t pos = 0;
+  while (pos < s.st_size) {
+    ssize_t got = pread(file, &entry->body[pos], s.st_size - pos, pos);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) return std::shared_ptr<CachedFile>();
+    pos += got;
+  }
+  entry->data = entry->body.data();
+  entry->size = s.st_size;
+  entry->mtime = s.st_mtime;
+  entry->checked = time(0);
+  entry->contentType = contentTypeForFile(path);
+  entry->encodedTried = 0;
+  entry->encodedPending = 0;
+  renderFields(entry.get());
+
+  std::unordered_map<std::string, LRUList::iterator>::iterator old = index.find(path);
+  if (old != index.end()) {
+    evict(old->second);
+  }
+  while (!lru.empty() && (used + entry->size > capacity)) {
+    evict(--lru.end());
+  }
+  lru.push_front(entry);
+  index[path] = lru.begin();
+  used += entry->size;
+  return entry;
+}
+
+//makes the variant of a cached body in the given encoding, from the .gz sibling of path or with zlib,
+//returning NULL if it would not be any smaller
+static std::shared_ptr<CachedFile> compressFile(const CachedFile &entry, const std::string &path, int encoding)
+{
+  //porters call this too, so only what never changes once the entry is cached is read from it
+  std::shared_ptr<CachedFile> variant(new CachedFile());
+  variant->path = entry.path;
+  variant->mtime = entry.mtime;
+  variant->checked = 0;
+  variant->contentType = entry.contentType;
+  variant->encodedTried = 0;
+  variant->encodedPending = 0;
+
+  //a precompressed sibling is used as long as it is at least as new as the file itself
+  int sibling = -1;
+  if (encoding == ENCODING_GZIP) {
+    sibling = openBeneath((path + ".gz").c_str(), O_RDONLY | O_NONBLOCK);
+  }
+  struct stat s;
+  if ((sibling != -1) && (fstat(sibling, &s) == 0) && S_ISREG(s.st_mode) && (S_IROTH & s.st_mode)
+      && (s.st_mtime >= entry.mtime) && (s.st_size <= CACHE_FILE_SIZ)) {
+    variant->body.resize(s.st_size);
+    off_t pos = 0;
+    while (pos < s.st_size) {
+      ssize_t got = pread(sibling, &variant->body[pos], s.st_size - pos, pos);
+      if (got == -1 && errno == EINTR) continue;
+      if (got <= 0) break;
+      pos += got;
+    }
+    variant->body.resize(pos);
+  } else {
+    //otherwise the body is compressed once, as hard as zlib can, since the result is kept
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int windowBits = (encoding == ENCODING_GZIP) ? 15 + 16 : 15;
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+      variant->body.resize(deflateBound(&zs, entry.size));
+      zs.next_in = (Bytef*) entry.data;
+      zs.avail_in = entry.size;
+      zs.next_out = (Bytef*) &variant->body[0];
+      zs.avail_out = variant->body.size();
+      if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+	variant->body.resize(zs.total_out);
+      } else {
+	variant->body.clear();
+      }
+      deflateEnd(&zs);
+    }
+  }
+  if (sibling != -1) {
+    close(sibling);
+  }
+  //bodies that would not shrink are sent as they are
+  if (variant->body.empty() || (variant->body.size() >= (size_t)entry.size)) {
+    return std::shared_ptr<CachedFile>();
+  }
+  variant->data = variant->body.data();
+  variant->size = variant->body.size();
+  variant->fields = std::string("Content-Type: ") + entry.contentType + "\r\n"
+    + ((encoding == ENCODING_GZIP) ? "Content-Encoding: gzip\r\n" : "Content-Encoding: deflate\r\n")
+    + "Vary: Accept-Encoding\r\n";
+  //the variant is a different body, so it only shares a weak ETag with the file
+  char validators[256];
+  variant->fields.append(validators, formatValidators(validators, sizeof(validators), entry.mtime, entry.size, 1));
+  char digits[24];
+  variant->fields += "Content-Length: ";
+  variant->fields.append(digits, formatNumber(digits, variant->size));
+  variant->fields += "\r\n";
+  return variant;
+}
+
+std::shared_ptr<CachedFile> FileCache::encode(std::shared_ptr<CachedFile> entry, int encoding)
+{
+  if (entry->encodedTried & (1 << encoding)) {
+    return entry->encoded[encoding];
+  }
+  adopt(entry, encoding, compressFile(*entry, entry->path, encoding));
+  return entry->encoded[encoding];
+}
+
+void FileCache::adopt(std::shared_ptr<CachedFile> entry, int encoding, std::shared_ptr<CachedFile> variant)
+{
+  entry->encodedTried |= 1 << encoding;
+  if (!variant) {
+    return;
+  }
+  entry->encoded[encoding] = variant;
+  //an entry evicted while a porter compressed it only keeps the variant for the requests holding it
+  std::unordered_map<std::string, LRUList::iterator>::iterator found = index.find(entry->path);
+  if ((found == index.end()) || (*found->second != entry)) {
+    return;
+  }
+  used += variant->size;
+  //the variant counts against the cache like any body, but never pushes out the entry it belongs to
+  while ((lru.size() > 1) && (used > capacity) && (lru.back() != entry)) {
+    evict(--lru.end());
+  }
+}
+
+struct OpenFile *FdCache::acquire(const std::string &path, struct stat *s, int file)
+{
+  std::unordered_map<std::string, struct OpenFile*>::iterator found = entries.find(path);
+  if (found != entries.end()) {
+    struct OpenFile *open = found->second;
+    if ((open->size == s->st_size) && (open->mtime == s->st_mtime) && (open->ino == s->st_ino)) {
+      if (file != -1) close(file);
+      open->refs++;
+      return open;
+    }
+    //the file was changed or replaced since it was opened, requests still sending keep the old one
+    drop(open);
+  }
+  if (file == -1) {
+    file = pathCache.open(path, s);
+    if (file == -1) {
+      return NULL;
+    }
+  }
+  struct OpenFile *open = new OpenFile();
+  open->path = path;
+  open->fd = file;
+  open->size = s->st_size;
+  open->mtime = s->st_mtime;
+  open->ino = s->st_ino;
+  open->refs = 1;
+  open->idleSince = 0;
+  open->cached = 1;
+  if (entries.size() >= capacity) {
+    //the descriptor idle the longest makes room, and when all are busy this one is not kept
+    struct OpenFile *oldest = NULL;
+    for (found = entries.begin(); found != entries.end(); ++found) {
+      struct OpenFile *candidate = found->second;
+      if ((candidate->refs == 0) && ((oldest == NULL) || (candidate->idleSince < oldest->idleSince))) {
+	oldest = candidate;
+      }
+    }
+    if (oldest != NULL) {
+      drop(oldest);
+    } else {
+      open->cached = 0;
+      return open;
+    }
+  }
+  entries[path] = open;
+  return open;
+}
+
+void FdCache::release(struct OpenFile *open)
+{
+  if (--open->refs > 0) {
+    return;
+  }
+  if (!open->cached) {
+    close(open->fd);
+    delete open;
+    return;
+  }
+  open->idleSince = time(0);
+}
+
+void FdCache::expire(time_t now, time_t idle)
+{
+  std::unordered_map<std::string, struct OpenFile*>::iterator it = entries.begin();
+  while (it != entries.end()) {
+    struct OpenFile *open = it->second;
+    if ((open->refs == 0) && (now - open->idleSince >= idle)) {
+      it = entries.erase(it);
+      close(open->fd);
+      delete open;
+    } else {
+      ++it;
+    }
+  }
+}
+
+void FdCache::drop(struct OpenFile *open)
+{
+  entries.erase(open->path);
+  open->cached = 0;
+  if (open->refs == 0) {
+    close(open->fd);
+    delete open;
+  }
+}
+
+void BlockingPool::start(int threads)
+{
+  sem_init(&waiting, 0, 0);
+  for (int i = 0; i < threads; i++) {
+    lanes.push_back(std::unique_ptr<Lane>(new Lane()));
+  }
+  for (int i = 0; i < threads; i++) {
+    std::thread(&BlockingPool::porter, this, (size_t)i).detach();
+  }
+}
+
+void BlockingPool::submit(struct BlockingJob *job)
+{
+  Lane &lane = *lanes[next.fetch_add(1, std::memory_order_relaxed) % lanes.size()];
+  {
+    std::lock_guard<std::mutex> hold(lane.lock);
+    lane.jobs.push_back(job);
+  }
+  sem_post(&waiting);
+}
+
+//a porter's own lane is taken from the front, the oldest job, and the others are robbed from the back
+struct BlockingJob *BlockingPool::take(size_t self)
+{
+  for (size_t i = 0; i < lanes.size(); i++) {
+    Lane &lane = *lanes[(self + i) % lanes.size()];
+    std::lock_guard<std::mutex> hold(lane.lock);
+    if (lane.jobs.empty()) continue;
+    struct BlockingJob *job;
+    if (i == 0) {
+      job = lane.jobs.front();
+      lane.jobs.pop_front();
+    } else {
+      job = lane.jobs.back();
+      lane.jobs.pop_back();
+    }
+    return job;
+  }
+  return NULL;
+}
+
+// reads len bytes of file from offset into the page cache, the bytes themselves are thrown away
+static void warmFile(int file, off_t offset, off_t len, char *scratch)
+{
+  while (len > 0) {
+    ssize_t got = pread(file, scratch, (len < WARM_SIZ) ? len : WARM_SIZ, offset);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) return;
+    offset += got;
+    len -= got;
+  }
+}
+
+void BlockingPool::porter(size_t self)
+{
+  char *scratch = (char*) malloc(WARM_SIZ);
+  while (true) {
+    if (sem_wait(&waiting) == -1) continue;
+    // every post is a job not taken yet, so one is found in some lane
+    struct BlockingJob *job = take(self);
+    if (job == NULL) continue;
+    if (job->kind == JOB_RESOLVE) {
+      int file;
+      job->status = lookupPath(job->path, &job->s, &file);
+      if (file != -1) {
+	warmFile(file, 0, (job->s.st_size < WARM_SIZ) ? job->s.st_size : WARM_SIZ, scratch);
+	close(file);
+	//negotiateEncoding looks for a precompressed sibling of every file it could compress
+	int sibling = openBeneath((job->path + ".gz").c_str(), O_RDONLY | O_NONBLOCK);
+	if (sibling != -1) {
+	  warmFile(sibling, 0, WARM_SIZ, scratch);
+	  close(sibling);
+	}
+      }
+    } else if (job->kind == JOB_ENCODE) {
+      if (job->entry) {
+	job->variant = compressFile(*job->entry, job->entry->path, job->encoding);
+      } else {
+	job->sibling = openSibling(job->path, job->file, &job->len);
+      }
+    } else {
+      warmFile(job->file, job->offset, job->len, scratch);
+    }
+    struct Mailbox *box = job->mailbox;
+    {
+      std::lock_guard<std::mutex> hold(box->lock);
+      box->done.push_back(job);
+    }
+    uint64_t one = 1;
+    while ((write(box->fd, &one, sizeof(one)) == -1) && (errno == EINTR));
+  }
+}
+
+// the connection holds still, and stays open, until the job comes back
+static void submitJob(struct BlockingJob *job)
+{
+  job->mailbox = &mailbox;
+  job->conn->job = job;
+  job->conn->inflight++;
+  bump(stats->offloaded, (uint64_t)1);
+  blockingPool.submit(job);
+}
+
+int deferRequest(struct Request *curReq)
+{
+  if ((mailbox.fd == -1) || curReq->deferred || pathCache.fresh(curReq->path)) {
+    return 0;
+  }
+  struct BlockingJob *job = new BlockingJob();
+  job->kind = JOB_RESOLVE;
+  job->conn = curReq->conn;
+  job->req = curReq;
+  job->path = curReq->path;
+  submitJob(job);
+  return 1;
+}
+
+int deferEncode(struct Request *curReq, int encoding)
+{
+  if (mailbox.fd == -1) {
+    return 0;
+  }
+  struct BlockingJob *job = new BlockingJob();
+  job->kind = JOB_ENCODE;
+  job->conn = curReq->conn;
+  job->req = curReq;
+  job->encoding = encoding;
+  job->sibling = -1;
+  if (curReq->cached) {
+    job->entry = curReq->cached;
+    curReq->cached->encodedPending |= 1 << encoding;
+  } else {
+    job->path = curReq->path;
+    job->file = curReq->file;
+  }
+  submitJob(job);
+  return 1;
+}
+
+void deferRead(struct Request *curReq, off_t len)
+{
+  struct BlockingJob *job = new BlockingJob();
+  job->kind = JOB_READ;
+  job->conn = curReq->conn;
+  job->req = curReq;
+  job->file = curReq->file;
+  job->offset = curReq->filepos;
+  job->len = len;
+  submitJob(job);
+}
+
+void collectJobs()
+{
+  uint64_t count;
+  while ((read(mailbox.fd, &count, sizeof(count)) == -1) && (errno == EINTR));
+  std::vector<struct BlockingJob*> done;
+  {
+    std::lock_guard<std::mutex> hold(mailbox.lock);
+    done.swap(mailbox.done);
+  }
+  for (size_t i = 0; i < done.size(); i++) {
+    struct BlockingJob *job = done[i];
+    struct Connection *conn = job->conn;
+    conn->job = NULL;
+    conn->inflight--;
+    if ((job->kind == JOB_ENCODE) && job->entry) {
+      //the variant is kept even when the connection that asked for it is gone
+      job->entry->encodedPending &= ~(1 << job->encoding);
+      fileCache.adopt(job->entry, job->encoding, job->variant);
+    }
+    if (conn->dead) {
+      //a request still waiting to be answered belongs to nobody else, one being sent to the connection
+      if ((job->kind == JOB_ENCODE) && (job->sibling != -1)) close(job->sibling);
+      if (job->kind != JOB_READ) {
+	releaseFile(job->req);
+	requestPool.release(job->req);
+      }
+      if (conn->inflight == 0) releaseConnection(conn);
+      delete job;
+      continue;
+    }
+    conn->lastActive = time(0);
+    if (job->kind == JOB_RESOLVE) {
+      //the request is handled from the start, the lookup is now cached and the file in memory
+      pathCache.remember(job->path, job->status, (job->status == 200) ? &job->s : NULL);
+      job->req->deferred = 1;
+      handleRequest(job->req);
+    } else if (job->kind == JOB_ENCODE) {
+      //the request goes on from negotiateEncoding, with whatever the porter made of it
+      if (job->variant) {
+	useVariant(job->req, job->variant, job->encoding);
+      } else if (job->sibling != -1) {
+	useSibling(job->req, job->sibling, job->len);
+      }
+      respondWithBody(job->req);
+    } else {
+      job->req->warmTo = job->offset + job->len;
+    }
+    delete job;
+    if (ioBackend == IO_URING) {
+      uringServe(conn);
+    } else if (!conn->queued && !conn->parked) {
+      serveConnection(conn);
+    }
+  }
+}
+
+std::shared_ptr<DocIndex> DocIndex::build(int contents)
+{
+  long long started = nowMicros();
+  std::shared_ptr<DocIndex> index(new DocIndex());
+  index->walk(rootFd, "");
+  struct Before {
+    const std::string &names;
+    Before(const std::string &n): names(n) {}
+    bool operator()(const IndexEntry &a, const IndexEntry &b) const {
+      return names.compare(a.name, a.nameLen, names, b.name, b.nameLen) < 0;
+    }
+  };
+  std::sort(index->entries.begin(), index->entries.end(), Before(index->names));
+
+  if (contents) {
+    //the arena is sized for every small file up front, so bodies never move once they are read
+    size_t total = 0;
+    for (size_t i = 0; i < index->entries.size(); i++) {
+      IndexEntry &entry = index->entries[i];
+      if ((entry.size <= CACHE_FILE_SIZ) && (total + entry.size <= PRELOAD_SIZ)) {
+	total += entry.size;
+      }
+    }
+    if (total > 0) {
+      index->arena = (char*) mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (index->arena == MAP_FAILED) {
+	logMessage(LOG_ERROR, "could not map a preload arena of %zu bytes", total);
+	index->arena = NULL;
+	total = 0;
+      }
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < index->entries.size(); i++) {
+      IndexEntry &entry = index->entries[i];
+      std::string path = index->names.substr(entry.name, entry.nameLen);
+      if ((entry.size > CACHE_FILE_SIZ) || (used + entry.size > total)) {
+	//what does not fit is left to the page cache, which is asked to read it ahead now
+	int file = openBeneath(path.c_str(), O_RDONLY | O_NONBLOCK);
+	if (file != -1) {
+	  posix_fadvise(file, 0, 0, POSIX_FADV_WILLNEED);
+	  close(file);
+	}
+	continue;
+      }
+      //the validators are those of the descriptor the body is read through, and must still hold once it is read
+      int file = openBeneath(path.c_str(), O_RDONLY | O_NONBLOCK);
+      struct stat before, after;
+      off_t pos = 0;
+      if ((file != -1) && ((fstat(file, &before) == -1) || (before.st_size != entry.size))) {
+	close(file);
+	file = -1;
+      }
+      while ((file != -1) && (pos < entry.size)) {
+	ssize_t got = pread(file, index->arena + used + pos, entry.size - pos, pos);
+	if (got == -1 && errno == EINTR) continue;
+	if (got <= 0) break;
+	pos += got;
+      }
+      int unchanged = (file != -1) && (pos == entry.size) && (fstat(file, &after) == 0)
+	&& (after.st_size == before.st_size) && (after.st_mtime == before.st_mtime);
+      if (file != -1) close(file);
+      if (!unchanged) {
+	//a file that changed underneath the walk is left to be read from disk
+	continue;
+      }
+      entry.mtime = before.st_mtime;
+      index->bodies.push_back(CachedFile());
+      CachedFile &body = index->bodies.back();
+      body.path = path;
+      body.data = index->arena + used;
+      body.size = entry.size;
+      body.mtime = entry.mtime;
+      body.checked = 0;
+      body.contentType = contentTypeForFile(path);
+      renderFields(&body);
+      //the variants are made now, since nothing may change in an index once workers share it
+      if (isCompressible(body.contentType)) {
+	for (int encoding = ENCODING_GZIP; encoding <= ENCODING_DEFLATE; encoding++) {
+	  body.encoded[encoding] = compressFile(body, path, encoding);
+	}
+      }
+      body.encodedTried = (1 << ENCODINGS) - 1;
+      body.encodedPending = 0;
+      entry.file = &body;
+      used += entry.size;
+    }
+    if (index->arena != NULL) {
+      mprotect(index->arena, total, PROT_READ);
+      index->arenaLen = total;
+    }
+  } else {
+    //bodies are only ever read from disk, so the page cache is asked to read every file ahead now
+    for (size_t i = 0; i < index->entries.size(); i++) {
+      IndexEntry &entry = index->entries[i];
+      int file = openBeneath(index->names.substr(entry.name, entry.nameLen).c_str(), O_RDONLY | O_NONBLOCK);
+      if (file != -1) {
+	posix_fadvise(file, 0, 0, POSIX_FADV_WILLNEED);
+	close(file);
+      }
+    }
+  }
+  logMessage(LOG_INFO, "indexed %zu files of %s, %zu bytes preloaded, in %lld ms", index->files(),
+	     rootDirectory.c_str(), index->preloaded(), (nowMicros() - started) / 1000);
+  return index;
+}
+
+//adds every readable regular file below dir, following only the symlinks that stay beneath the root
+void DocIndex::walk(int dir, const std::string &prefix)
+{
+  struct stat self;
+  if (fstat(dir, &self) == -1) {
+    return;
+  }
+  //a link back to a directory already being walked would never end, so it is left out
+  for (size_t i = 0; i < walking.size(); i++) {
+    if ((walking[i].first == self.st_dev) && (walking[i].second == self.st_ino)) return;
+  }
+  int listing = openat(dir, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *directory = (listing == -1) ? NULL : fdopendir(listing);
+  if (directory == NULL) {
+    if (listing != -1) close(listing);
+    return;
+  }
+  walking.push_back(std::make_pair(self.st_dev, self.st_ino));
+  struct dirent *found;
+  while ((found = readdir(directory)) != NULL) {
+    if ((strcmp(found->d_name, ".") == 0) || (strcmp(found->d_name, "..") == 0)) continue;
+    struct stat s;
+    if (fstatat(dir, found->d_name, &s, AT_SYMLINK_NOFOLLOW) == -1) continue;
+    std::string path = prefix + found->d_name;
+    int sub = -1;
+    if (S_ISLNK(s.st_mode)) {
+      //requests follow a link that stays beneath the root, so it is indexed as whatever it leads to
+      int target = openBeneath(path.c_str(), O_PATH);
+      int followed = (target != -1) && (fstat(target, &s) == 0);
+      if (followed && S_ISDIR(s.st_mode)) {
+	sub = target;
+      } else if (target != -1) {
+	close(target);
+      }
+      if (!followed) continue;
+    } else if (S_ISDIR(s.st_mode)) {
+      sub = openat(dir, found->d_name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (S_ISDIR(s.st_mode)) {
+      if (sub != -1) {
+	walk(sub, path + "/");
+	close(sub);
+      }
+    } else if (S_ISREG(s.st_mode) && (S_IROTH & s.st_mode)) {
+      IndexEntry entry;
+      entry.name = names.length();
+      entry.nameLen = path.length();
+      entry.size = s.st_size;
+      entry.mtime = s.st_mtime;
+      entry.file = NULL;
+      names += path;
+      entries.push_back(entry);
+    }
+  }
+  closedir(directory);
+  walking.pop_back();
+}
+
+const IndexEntry *DocIndex::find(const std::string &path) const
+{
+  size_t low = 0;
+  size_t high = entries.size();
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    int order = names.compare(entries[mid].name, entries[mid].nameLen, path);
+    if (order == 0) return &entries[mid];
+    if (order < 0) low = mid + 1;
+    else high = mid;
+  }
+  return NULL;
+}
+
+void refreshIndex()
+{
+  unsigned generation = indexGeneration.load(std::memory_order_acquire);
+  if (generation != workerGeneration) {
+    workerIndex = std::atomic_load(&docIndex);
+    workerGeneration = generation;
+  }
+}
+
+void indexRebuilder()
+{
+  sigset_t hup;
+  sigemptyset(&hup);
+  sigaddset(&hup, SIGHUP);
+  while (true) {
+    int sig;
+    if (sigwait(&hup, &sig) != 0) continue;
+    //the old index keeps serving until the new one is complete, and lives on while anything sends from it
+    logMessage(LOG_INFO, "rebuilding the preload index");
+    std::shared_ptr<DocIndex> fresh = DocIndex::build(preloadMode == PRELOAD_CONTENTS);
+    std::atomic_store(&docIndex, fresh);
+    indexGeneration++;
+  }
+}
+
+void FileCache::evict(LRUList::iterator entry)
+{
+  used -= (*entry)->size;
+  for (int i = 0; i < ENCODINGS; i++) {
+    if ((*entry)->encoded[i]) used -= (*entry)->encoded[i]->size;
+  }
+  index.erase((*entry)->path);
+  lru.erase(entry);
+}
+
+int URing::setup(unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // only this worker submits, and completions are reaped when it enters the kernel anyway
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+  fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd == -1) {
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+  }
+  if (fd == -1) {
+    logMessage(LOG_ERROR, "io_uring_setup failed: %s", strerror(errno));
+    return -1;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    logMessage(LOG_ERROR, "io_uring of this kernel is too old");
+    close(fd);
+    return -1;
+  }
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  char *rings = (char*) mmap(NULL, std::max(sqSize, cqSize), PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  sqes = (struct io_uring_sqe*) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+				     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+    logMessage(LOG_ERROR, "could not map the io_uring: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  sqEntries = params.sq_entries;
+  sqHead = (unsigned*)(rings + params.sq_off.head);
+  sqTail = (unsigned*)(rings + params.sq_off.tail);
+  sqMask = *(unsigned*)(rings + params.sq_off.ring_mask);
+  // submissions always sit in the slot of the same index
+  unsigned *sqArray = (unsigned*)(rings + params.sq_off.array);
+  for (unsigned i = 0; i < sqEntries; i++) sqArray[i] = i;
+  cqHead = (unsigned*)(rings + params.cq_off.head);
+  cqTail = (unsigned*)(rings + params.cq_off.tail);
+  cqMask = *(unsigned*)(rings + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+
+  bufRing = (struct io_uring_buf_ring*) mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+					     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  buffers = (char*) malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZ);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid = URING_BGID;
+  if (bufRing == MAP_FAILED || buffers == NULL
+      || syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    logMessage(LOG_ERROR, "could not register the io_uring receive buffers: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  bufTail = 0;
+  for (int bid = 0; bid < URING_BUFFERS; bid++) recycleBuffer(bid);
+  return 0;
+}
+
+struct io_uring_sqe *URing::getSqe(unsigned n)
+{
+  unsigned tail = *sqTail + pending;
+  if (tail + n - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqEntries) {
+    // the ring is full, what is in it goes to the kernel now
+    if (submit(0, 0) == -1) return NULL;
+    tail = *sqTail;
+    if (tail + n - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqEntries) return NULL;
+  }
+  struct io_uring_sqe *sqe = &sqes[tail & sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  pending++;
+  return sqe;
+}
+
+int URing::submit(int wait, int timeoutMs)
+{
+  unsigned toSubmit = pending;
+  __atomic_store_n(sqTail, *sqTail + pending, __ATOMIC_RELEASE);
+  pending = 0;
+  if (!toSubmit && !wait) {
+    return 0;
+  }
+  struct __kernel_timespec ts;
+  ts.tv_sec = timeoutMs / 1000;
+  ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.ts = (uint64_t)(uintptr_t)&ts;
+  unsigned flags = wait ? (IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG) : 0;
+  while (true) {
+    int ret = syscall(__NR_io_uring_enter, fd, toSubmit, wait ? 1 : 0, flags,
+		      wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    if (ret >= 0 || errno == ETIME) return 0;
+    if (errno == EINTR) {
+      if (!wait) return 0;
+      continue;
+    }
+    if (errno == EAGAIN || errno == EBUSY) {
+      // the completion queue is full, the caller reaps it and the submissions go in next time
+      return 0;
+    }
+    logMessage(LOG_ERROR, "io_uring_enter failed: %s", strerror(errno));
+    return -1;
+  }
+}
+
+struct io_uring_cqe *URing::peekCqe()
+{
+  unsigned head = *cqHead;
+  if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &cqes[head & cqMask];
+}
+
+void URing::seenCqe()
+{
+  __atomic_store_n(cqHead, *cqHead + 1, __ATOMIC_RELEASE);
+}
+
+void URing::recycleBuffer(int bid)
+{
+  // the ring is indexed by hand, the header's flexible array member lands at a different offset in C++
+  struct io_uring_buf *buf = (struct io_uring_buf*)bufRing + (bufTail & (URING_BUFFERS - 1));
+  buf->addr = (uint64_t)(uintptr_t)buffer(bid);
+  buf->len = URING_BUFFER_SIZ;
+  buf->bid = bid;
+  bufTail++;
+  __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+void BufferPool::acquire(struct ReadBuffer *buf, size_t size)
+{
+  int c = 0;
+  while ((size_t)(REQ_SIZ << c) < size && c < CLASSES - 1) c++;
+  size_t blockSize = REQ_SIZ << c;
+  if (freeBlocks[c].empty()) {
+    // a whole slab is carved up at once, and it is never given back
+    char *slab = (char*) malloc(blockSize * SLAB_BLOCKS);
+    if (slab == NULL) {
+      logFatal("out of memory for read buffers");
+    }
+    freeBlocks[c].reserve(freeBlocks[c].size() + SLAB_BLOCKS);
+    for (int i = 0; i < SLAB_BLOCKS; i++) {
+      freeBlocks[c].push_back(slab + i * blockSize);
+    }
+  }
+  buf->data = freeBlocks[c].back();
+  freeBlocks[c].pop_back();
+  buf->len = 0;
+  buf->cap = blockSize;
+}
+
+int BufferPool::grow(struct ReadBuffer *buf)
+{
+  if (buf->cap >= MAX_REQ_SIZ) {
+    return 0;
+  }
+  struct ReadBuffer bigger;
+  acquire(&bigger, buf->cap * 2);
+  memcpy(bigger.data, buf->data, buf->len);
+  bigger.len = buf->len;
+  release(buf);
+  *buf = bigger;
+  return 1;
+}
+
+void BufferPool::release(struct ReadBuffer *buf)
+{
+  if (buf->data == NULL) {
+    return;
+  }
+  int c = 0;
+  while ((size_t)(REQ_SIZ << c) < buf->cap) c++;
+  freeBlocks[c].push_back(buf->data);
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
+
+// finds the ring of the calling thread, creating it the first time
+static LogRing *ownLogRing()
+{
+  if (logRing == NULL) {
+    logRing = new LogRing();
+    std::lock_guard<std::mutex> guard(logRingsLock);
+    logRings.push_back(logRing);
+  }
+  return logRing;
+}
 
-// This method uses a simple herustic to return a variable timeout for a connection
-int getTimeout();
+// claims the next free record of the calling thread's ring, or NULL if the ring is full
+static LogRecord *claimLogRecord()
+{
+  LogRing *ring = ownLogRing();
+  size_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_SIZ) {
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return NULL;
+  }
+  return &ring->records[head & (LOG_RING_SIZ - 1)];
+}
 
-// This method will cycle through requests...
-int eventProcessor();
+// hands the claimed record over to the log writer
+static void publishLogRecord()
+{
+  logRing->head.store(logRing->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
 
-//Decides whether to spawn a thread to listen to the socket for 10 seconds more. 
-int doesListenMore(Request *curReq);
+void logMessage(int level, const char *format, ...)
+{
+  if (level > logLevel) return;
+  LogRecord *record = claimLogRecord();
+  if (record == NULL) return;
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(record->data, sizeof(record->data), format, args);
+  va_end(args);
+  if (len < 0) return;
+  record->kind = LOG_KIND_MESSAGE;
+  record->level = level;
+  record->len = (len < (int)sizeof(record->data)) ? len : sizeof(record->data) - 1;
+  publishLogRecord();
+}
 
+void logAccess(struct Request *curReq)
+{
+  if (accessLogFd == -1) return;
+  LogRecord *record = claimLogRecord();
+  if (record == NULL) return;
+  struct AccessRecord access;
+  access.time = time(0);
+  access.micros = nowMicros() - curReq->started;
+  access.bytes = curReq->bodylen;
+  access.status = curReq->status;
+  access.method = curReq->methodCode;
+  size_t room = sizeof(record->data) - sizeof(access);
+  access.urilen = (curReq->requestURI.length() < room) ? curReq->requestURI.length() : room;
+  memcpy(record->data, &access, sizeof(access));
+  memcpy(record->data + sizeof(access), curReq->requestURI.data(), access.urilen);
+  record->kind = LOG_KIND_ACCESS;
+  record->len = sizeof(access) + access.urilen;
+  publishLogRecord();
+}
 
-/** Request Structure
- *  This contains all the information in a request, and are loaded into the event queue
- *  It encapsulates all the necessary information for a request in one structure
- */
+// writes everything in out to fd, giving up on errors since there is nowhere left to report them
+static void writeAll(int fd, std::string &out)
+{
+  size_t done = 0;
+  while (done < out.length()) {
+    ssize_t wrote = write(fd, out.data() + done, out.length() - done);
+    if (wrote == -1 && errno == EINTR) continue;
+    if (wrote <= 0) break;
+    done += wrote;
+  }
+  out.clear();
+}
 
-struct Request {
-  int socket;
-  std::string reqstr;
-  std::string method;
-  std::string requestURI;
-  std::string version;
-  std::ifstream *file;
-  int filesize;
-  int filepos;
-  int continues;
-  
-  Request(int sock, std::string rsIn):socket(sock),
-				      reqstr(rsIn),
-				      method(),
-				      requestURI(),
-				      version(),
-				      file(),
-				      filesize(),
-				      filepos(0),
-				      continues(0) {}
-};
+void logFatal(const char *format, ...)
+{
+  //the log writer may never get to a queued record before the exit, so this one skips the rings
+  char line[LOG_RECORD_SIZ];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line) - 1, format, args);
+  va_end(args);
+  if (len < 0) len = 0;
+  if (len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+  line[len++] = '\n';
+  std::string out = "[error] ";
+  out.append(line, len);
+  writeAll(STDERR_FILENO, out);
+  exit(1);
+}
 
-/**
- * Forever loop: 
- *   Listen for connections (Done) 
- *   Accept new connection from incoming client (Done) 
- *   Parse HTTP request (Done)
- *   Ensure well-formed request (return error otherwise) (Done) 
- *   Determine if target file exists and if permissions are set properly (return error otherwise) (Done)
- *   Transmit contents of file to connect (by performing reads on the file and writes on the socket) (Done) 
- *   Close the connection (if HTTP/1.0) (Done)
- */
-int mainListener(int port)
+void logWriter()
 {
-  // This is the main socket that all incoming connections come through
-  int mainSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  struct sockaddr_in my_addr;
-  my_addr.sin_family = AF_INET;
-  my_addr.sin_port = htons(port);
-  my_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  int uno = 1;
-  setsockopt(mainSock,SOL_SOCKET, SO_REUSEADDR, &uno, sizeof(uno) == -1);
-  if (bind(mainSock, (struct sockaddr *)&my_addr, sizeof(my_addr)) == -1) exit(1);    
-  listen(mainSock, MAX_BACKLOG);
-  // This infinite while loop handles all server operations
-  while(true)
+  static const char *levels[] = { "", "error", "info", "debug" };
+  static const char *methods[] = { "-", "GET", "HEAD", "OPTIONS" };
+  std::vector<LogRing*> rings;
+  std::string messages;
+  std::string accesses;
+  while (true) {
     {
-      // This is where new connections are accepted and added to the eventQueue if necessary
-      int newSock = 0;
-      int addrlenp = sizeof(my_addr);
-      char *buf = (char*) malloc (REQ_SIZ);
-      //If we reach a connection attempt. 
-      if ( (newSock = accept(mainSock,(struct sockaddr *)&my_addr,(socklen_t *)&addrlenp)) > 0 ) {  
-	int pos = 0;
-	while((strstr(buf,"\r\n\r\n") == NULL)&&(strstr(buf,"\n\n") == NULL)) {
-	  //Receive piece of client request and store it in a char*
-	  pos = recv(newSock, buf+pos, REQ_SIZ, 0);
+      std::lock_guard<std::mutex> guard(logRingsLock);
+      rings = logRings;
+    }
+    size_t drained = 0;
+    for (size_t i = 0; i < rings.size(); i++) {
+      LogRing *ring = rings[i];
+      size_t tail = ring->tail.load(std::memory_order_relaxed);
+      size_t head = ring->head.load(std::memory_order_acquire);
+      for (; tail != head; tail++) {
+	LogRecord *record = &ring->records[tail & (LOG_RING_SIZ - 1)];
+	if (record->kind == LOG_KIND_MESSAGE) {
+	  messages += "[";
+	  messages += levels[record->level];
+	  messages += "] ";
+	  messages.append(record->data, record->len);
+	  messages += "\n";
+	} else if (accessLogBinary) {
+	  accesses.append(record->data, record->len);
+	} else {
+	  struct AccessRecord access;
+	  memcpy(&access, record->data, sizeof(access));
+	  char line[LOG_RECORD_SIZ + 64];
+	  int len = snprintf(line, sizeof(line), "%u %s %u %llu %u %.*s\n", access.time,
+			     methods[access.method], access.status, (unsigned long long)access.bytes,
+			     access.micros, access.urilen, record->data + sizeof(access));
+	  accesses.append(line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
 	}
-	std::string reqstr(buf);
-	std::cout << "\n\nHANDLING NEW CLIENT REQUEST:\n"
-		  << "***************************************\n"
-		  << reqstr
-		  << "^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^\n";
-	// creates a new request struct for this instance using the 2 parameter constructor
-	struct Request *curReq = new Request(newSock,reqstr);
-	connectionsOpen++;
-	handleRequest(curReq);
-	free(buf);
-      }      
+	drained++;
+      }
+      ring->tail.store(tail, std::memory_order_release);
+      size_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+      if (dropped > 0 && logLevel >= LOG_ERROR) {
+	char line[64];
+	snprintf(line, sizeof(line), "[error] %zu log records dropped\n", dropped);
+	messages += line;
+      }
     }
+    if (!messages.empty()) writeAll(STDOUT_FILENO, messages);
+    if (!accesses.empty()) writeAll(accessLogFd, accesses);
+    if (drained == 0) {
+      usleep(LOG_IDLE);
+    }
+  }
 }
 
-// the method to continue listening to a socket for further requests
-int continueListen(int socket)
+long long nowMicros()
 {
-  struct pollfd fds;
-  fds.fd = socket;
-  fds.events = POLLIN | POLLPRI;
-  fds.revents = POLLIN | POLLPRI;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-  int retval = poll(&fds, 1, getTimeout());
+long long nowNanos()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-  std::cout << "done listening on socket: "<< socket <<" with poll call returning: "<< retval <<"\n";
-  if (retval == 0) { //Time out occured
-    close(socket);
-    return 0;
-  } else if (retval == -1) { //if there was an error
-    close(socket);
-    return 0;
-  } else if (retval) { //Else, we have data on the socket.
-    char *buf = (char*)malloc(REQ_SIZ);
-    
-    int pos = 0;
-    while((strstr(buf,"\r\n\r\n") == NULL)&&(strstr(buf,"\n\n") == NULL)) {
-      //Receive client request and store it in a string
-      pos = recv(socket, buf+pos, REQ_SIZ, 0);
-    }
-    std::string reqstr(buf);
-       
-    std::cout << "\n\nHANDLING REQUEST FROM PREVIOUS CLIENT:\n"
-	      << "***************************************\n"
-	      << reqstr
-	      << "^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^\n";
-    
-    struct Request *curReq = new Request(socket,reqstr);
-    handleRequest(curReq);
-    free(buf);
-    return 0;
+int Histogram::bucketFor(uint64_t value)
+{
+  if (value < (1ULL << HIST_SUB_BITS)) {
+    return value;
   }
-  std::cout << "code should never fall to here in continueListen\n";
-  return 0;
+  if (value >= (1ULL << HIST_MAGNITUDES)) {
+    return HIST_BUCKETS - 1;
+  }
+  //the top HIST_SUB_BITS bits below the leading one pick the bucket within its power of two
+  int magnitude = 63 - __builtin_clzll(value);
+  int shift = magnitude - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) + (int)(value >> shift) - (1 << HIST_SUB_BITS);
 }
 
-//This is where we have a forever while loop that looks for events in the queue to process. 
-int eventProcessor(){
-  while (true){
-    if (!eventQueue.empty()){
-      respondToGET(eventQueue.front());
-      eventQueue.pop();
-    }
+uint64_t Histogram::bucketTop(int bucket)
+{
+  if (bucket < (1 << HIST_SUB_BITS)) {
+    return bucket;
   }
+  int shift = (bucket >> HIST_SUB_BITS) - 1;
+  uint64_t sub = (bucket & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS);
+  return ((sub + 1) << shift) - 1;
+}
 
-  return 0;
+void Histogram::record(uint64_t value)
+{
+  bump(counts[bucketFor(value)], (uint64_t)1);
+  bump(sum, value);
 }
 
-/* ***************************************************************************************
- * This is the main method, spawning all the necessary starting threads for server operation
- *
- */
-int main(int argc, char** argv)
+void registerStats()
 {
-  //rootDirectory = std::string("/home/cs-students/16amt4/cs339/server/files");
-  //rootDirectory = std::string("/home/cs-students/16dpg3/distSystems/workingserver/files");
+  stats = new WorkerStats();
+  std::lock_guard<std::mutex> guard(allStatsLock);
+  allStats.push_back(stats);
+}
 
-  std::string port;
-  if (argc < 5) {
-    //not enough parameters passed in
-    std::cout << "Usage is -document_root <path> -port <int>\n";
-    return 0;;
-  } else { // if we got enough parameters...
-    for (int i = 1; i < argc; i++) { /* We will iterate over argv[] to get the parameters stored inside.
-				      * Note that we're starting on 1 because we don't need to know the 
-				      * path of the program, which is stored in argv[0] */
-      std::string current = std::string(argv[i]);
-      if (i + 1 != argc) // Check that we haven't finished parsing already
-	if (current.compare("-document_root") == 0) {
-	  // We know the next argument *should* be the filename:
-	  rootDirectory = std::string(argv[i + 1]);
-	} else if (current.compare("-port") == 0) {
-	  port = std::string(argv[i + 1]);
-	} else {
-	  //std::cout << "Not enough or invalid arguments, please try again.\n";
-	}
-    }
+// the value below which the given fraction of a merged histogram's samples fall
+static uint64_t histogramPercentile(const std::vector<uint64_t> &counts, uint64_t total, double fraction)
+{
+  uint64_t rank = (uint64_t)(fraction * total);
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen > rank) return Histogram::bucketTop(i);
   }
-  
-  int iPort = atoi(port.c_str());
-  std::thread navi(mainListener, iPort);
-  std::thread mailman(eventProcessor);
-  navi.join();
-  mailman.join();
-  exit(0);
+  return 0;
 }
 
-/**
- * This method is dispatched called within a detatches thread and handles requests
- */
-void handleRequest(struct Request *curReq) {
-  //if the basic format of the request is correct... 
-  if (regexGuard(curReq->reqstr)) {
-
-    char* reqcstr = (char*)curReq->reqstr.c_str();
-    // gets the string for method
-    curReq->method = std::string(strtok(reqcstr," "));
-    //sets the requestURI
-    curReq->requestURI = std::string(strtok(NULL," "));
-    //sets default path of '/' to '/index.html'
-    if (curReq->requestURI.compare("/") == 0) {
-      curReq->requestURI = "/index.html";
-    }
-    
-    curReq->version = std::string(strtok(NULL," \r\n"));
-    std::cout << "method: \"" << curReq->method
-	      << "\" requestURI: \"" << curReq->requestURI
-	      << "\" version: \"" << curReq->version << "\"\n";
-    
-    if ((curReq->continues = doesListenMore(curReq))) {
-      std::thread (continueListen, curReq->socket).detach();
+// adds one histogram of every worker into counts, returning the number of samples and their sum
+static uint64_t mergeHistograms(const std::vector<WorkerStats*> &workers, Histogram WorkerStats::*which,
+				std::vector<uint64_t> &counts, uint64_t *sum)
+{
+  uint64_t total = 0;
+  counts.assign(HIST_BUCKETS, 0);
+  *sum = 0;
+  for (size_t w = 0; w < workers.size(); w++) {
+    Histogram &h = workers[w]->*which;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+      uint64_t n = h.counts[i].load(std::memory_order_relaxed);
+      counts[i] += n;
+      total += n;
     }
+    *sum += h.sum.load(std::memory_order_relaxed);
+  }
+  return total;
+}
 
-    //tests for valid URI and then handles file opening
-    std::string statuscode;
-    
-    //if we are doing an options call
-    if (curReq->method.compare("OPTIONS") == 0) {
-      curReq->continues = doesListenMore(curReq);
-      respondToOPTIONS(curReq);
-      return;
+std::string renderStats(int prometheus)
+{
+  static const char *methods[] = { "other", "GET", "HEAD", "OPTIONS" };
+  static const char *histogramNames[] = { "parse", "header_build", "time_to_last_byte" };
+  static Histogram WorkerStats::*histograms[] = { &WorkerStats::parse, &WorkerStats::header,
+						   &WorkerStats::lastByte };
+  std::vector<WorkerStats*> workers;
+  {
+    std::lock_guard<std::mutex> guard(allStatsLock);
+    workers = allStats;
+  }
+  uint64_t requests[METHODS][STATUS_SLOTS] = {{0}};
+  uint64_t bytesSent = 0, cacheHits = 0, cacheMisses = 0, accepted = 0, rejected = 0, shed = 0;
+  uint64_t offloaded = 0;
+  int64_t open = 0, idle = 0, queueDepth = 0;
+  for (size_t w = 0; w < workers.size(); w++) {
+    WorkerStats *ws = workers[w];
+    for (int m = 0; m < METHODS; m++) {
+      for (int c = 0; c < STATUS_SLOTS; c++) {
+	requests[m][c] += ws->requests[m][c].load(std::memory_order_relaxed);
+      }
     }
+    bytesSent += ws->bytesSent.load(std::memory_order_relaxed);
+    cacheHits += ws->cacheHits.load(std::memory_order_relaxed);
+    cacheMisses += ws->cacheMisses.load(std::memory_order_relaxed);
+    accepted += ws->accepted.load(std::memory_order_relaxed);
+    rejected += ws->rejected.load(std::memory_order_relaxed);
+    shed += ws->shed.load(std::memory_order_relaxed);
+    offloaded += ws->offloaded.load(std::memory_order_relaxed);
+    open += ws->open.load(std::memory_order_relaxed);
+    idle += ws->idle.load(std::memory_order_relaxed);
+    queueDepth += ws->queueDepth.load(std::memory_order_relaxed);
+  }
 
-    if ((statuscode = URIGuard(curReq->requestURI)).compare("200 OK") == 0) {
-      std::string filepath = rootDirectory + curReq->requestURI;
-      //std::cout << "full path:" << filepath << "\n";
-      std::ifstream filestream(filepath);
-      //file was opened appropriately
-      if (filestream.is_open()) {
-	curReq->file = &filestream;
-	curReq->filesize = fileLength(filestream);
-	//std::cout << "in handleRequest filelength is: " << fileLength(*curReq->file) << "\n";
-	if ((strToUpper(curReq->method).compare("GET") == 0)) {
-	  //puts these requests onto the event queue because they are more process-intensive
-	  filestream.close();
-	  eventQueue.push(curReq);
-	  //close filestream here to reopen it in the other eventProcessor thread
-	} else if ((strToUpper(curReq->method).compare("HEAD") == 0)) {
-	  respondToHEAD(curReq);
+  std::string out;
+  char line[512];
+  if (prometheus) {
+    out += "# TYPE myserver_requests_total counter\n";
+    for (int m = 0; m < METHODS; m++) {
+      for (int c = 0; c < STATUS_SLOTS; c++) {
+	if (requests[m][c] == 0) continue;
+	char status[16];
+	if (c < STATUS_SLOTS - 1) snprintf(status, sizeof(status), "%d", statusCodes[c]);
+	else snprintf(status, sizeof(status), "other");
+	snprintf(line, sizeof(line), "myserver_requests_total{method=\"%s\",status=\"%s\"} %llu\n",
+		 methods[m], status, (unsigned long long)requests[m][c]);
+	out += line;
+      }
+    }
+    snprintf(line, sizeof(line),
+	     "# TYPE myserver_bytes_sent_total counter\nmyserver_bytes_sent_total %llu\n"
+	     "# TYPE myserver_cache_hits_total counter\nmyserver_cache_hits_total %llu\n"
+	     "# TYPE myserver_cache_misses_total counter\nmyserver_cache_misses_total %llu\n",
+	     (unsigned long long)bytesSent, (unsigned long long)cacheHits, (unsigned long long)cacheMisses);
+    out += line;
+    snprintf(line, sizeof(line),
+	     "# TYPE myserver_connections_accepted_total counter\nmyserver_connections_accepted_total %llu\n"
+	     "# TYPE myserver_connections_open gauge\nmyserver_connections_open %lld\n"
+	     "# TYPE myserver_connections_idle gauge\nmyserver_connections_idle %lld\n"
+	     "# TYPE myserver_queue_depth gauge\nmyserver_queue_depth %lld\n",
+	     (unsigned long long)accepted, (long long)open, (long long)idle, (long long)queueDepth);
+    out += line;
+    snprintf(line, sizeof(line),
+	     "# TYPE myserver_connections_rejected_total counter\nmyserver_connections_rejected_total %llu\n"
+	     "# TYPE myserver_connections_shed_total counter\nmyserver_connections_shed_total %llu\n"
+	     "# TYPE myserver_offloaded_total counter\nmyserver_offloaded_total %llu\n",
+	     (unsigned long long)rejected, (unsigned long long)shed, (unsigned long long)offloaded);
+    out += line;
+  } else {
+    snprintf(line, sizeof(line),
+	     "connections_open %lld\nconnections_idle %lld\nconnections_accepted %llu\n"
+	     "connections_rejected %llu\nconnections_shed %llu\nqueue_depth %lld\n"
+	     "bytes_sent %llu\ncache_hits %llu\ncache_misses %llu\noffloaded %llu\n",
+	     (long long)open, (long long)idle, (unsigned long long)accepted, (unsigned long long)rejected,
+	     (unsigned long long)shed, (long long)queueDepth,
+	     (unsigned long long)bytesSent, (unsigned long long)cacheHits, (unsigned long long)cacheMisses,
+	     (unsigned long long)offloaded);
+    out += line;
+    for (int m = 0; m < METHODS; m++) {
+      for (int c = 0; c < STATUS_SLOTS; c++) {
+	if (requests[m][c] == 0) continue;
+	if (c < STATUS_SLOTS - 1) {
+	  snprintf(line, sizeof(line), "requests %s %d %llu\n", methods[m], statusCodes[c],
+		   (unsigned long long)requests[m][c]);
 	} else {
-	  //method requested hasn't been implemented
-	  std::string errorStr = std::string("501 Not Implemented");
-	  respondWithError(curReq, errorStr);
-	}	
-	//A server SHOULD return the status code 405 (Method Not Allowed) if the method is known 
-	//by the orgin server but not allowed for the requested resource. 
-      } else {
-	std::cout << "Error opening file\n";
-	respondWithError(curReq, "404 File Not Found");
+	  snprintf(line, sizeof(line), "requests %s other %llu\n", methods[m],
+		   (unsigned long long)requests[m][c]);
+	}
+	out += line;
+      }
+    }
+  }
+
+  std::vector<uint64_t> counts;
+  for (int h = 0; h < 3; h++) {
+    uint64_t sum;
+    uint64_t total = mergeHistograms(workers, histograms[h], counts, &sum);
+    if (prometheus) {
+      //one bucket per power of two from a microsecond up keeps the series count small and fixed
+      snprintf(line, sizeof(line), "# TYPE myserver_%s_seconds histogram\n", histogramNames[h]);
+      out += line;
+      uint64_t cumulative = 0;
+      int bucket = 0;
+      for (int magnitude = 10; magnitude <= HIST_MAGNITUDES; magnitude++) {
+	for (; (bucket < HIST_BUCKETS) && (Histogram::bucketTop(bucket) < (1ULL << magnitude)); bucket++) {
+	  cumulative += counts[bucket];
+	}
+	snprintf(line, sizeof(line), "myserver_%s_seconds_bucket{le=\"%g\"} %llu\n", histogramNames[h],
+		 (double)(1ULL << magnitude) / 1e9, (unsigned long long)cumulative);
+	out += line;
       }
-      //ensures that the file is closed if something goes wrong
-      if (filestream.is_open()) { filestream.close(); }
+      snprintf(line, sizeof(line),
+	       "myserver_%s_seconds_bucket{le=\"+Inf\"} %llu\nmyserver_%s_seconds_sum %.9f\n"
+	       "myserver_%s_seconds_count %llu\n",
+	       histogramNames[h], (unsigned long long)total, histogramNames[h], sum / 1e9,
+	       histogramNames[h], (unsigned long long)total);
     } else {
-      std::cout << "Failed URI GUARD\n";
-      //client was trying to do something that was dissallowed by our URIGaurd
-      respondWithError(curReq, statuscode);
+      snprintf(line, sizeof(line), "%s_us count %llu mean %.1f p50 %.1f p99 %.1f p999 %.1f\n",
+	       histogramNames[h], (unsigned long long)total, total ? sum / 1e3 / total : 0.0,
+	       histogramPercentile(counts, total, 0.50) / 1e3, histogramPercentile(counts, total, 0.99) / 1e3,
+	       histogramPercentile(counts, total, 0.999) / 1e3);
     }
-  } else {
-    std::cout << "Failed RegexGuard\n";
-    respondWithError(curReq, "400 Bad Request");
+    out += line;
   }
+  return out;
 }
 
-//sends the file to the client a packet at a time
-int respondToGET(struct Request* curReq)
+void refreshDate(time_t now)
 {
-  std::ifstream filestream(rootDirectory + curReq->requestURI, std::ifstream::in);
-  //first call to this method, send header
-  if ((curReq->filepos) == 0) {
-    
-    //open the file within this thread
-    curReq->file = &filestream;
-
-    //store an integer in end that represents the number of characters in the file.
+  //RFC 7231 wants the fixed-length IMF date, always in GMT
+  struct tm tstruct;
+  gmtime_r(&now, &tstruct);
+  dateLineLen = strftime(dateLine, sizeof(dateLine), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tstruct);
+}
 
-    // This will send the header in its own packet
-    std::string header = getHeader(curReq, std::string("200 OK"));
-    send(curReq->socket, header.c_str(), header.length(), 0);
+size_t formatNumber(char *buf, unsigned long long n)
+{
+  //the digits come out backwards, so they are reversed in place afterwards
+  size_t len = 0;
+  do {
+    buf[len++] = '0' + (n % 10);
+    n /= 10;
+  } while (n != 0);
+  for (size_t i = 0; i < len / 2; i++) {
+    char swap = buf[i];
+    buf[i] = buf[len - 1 - i];
+    buf[len - 1 - i] = swap;
   }
+  return len;
+}
 
-  //initialize and resize the fileContents string to the size of a packet
-  std::string fileContents;
-  fileContents.resize(PACK_SIZ);
-  
-  // local variables to simplify implementation
-  int p = curReq->filepos;
-  int end = curReq->filesize;
-  //place a marker where we want to start reading.
-  (filestream).seekg(p);
-  
-  //if there is less than a packet to send resize our string to be this length
-  if ((end - p) < PACK_SIZ){
-    fileContents.resize((end-p));
-  }
-  //read at most a packet's worth of data into the string
-  filestream.read(&fileContents[0], fileContents.length());
-  send(curReq->socket, fileContents.c_str(), fileContents.length(), 0);
-  curReq->filepos += PACK_SIZ;
-  filestream.close();
-
-  if (curReq->filepos >= end) {
-    //we are done with the file, no need to add to the event queue
-    //just check if we need to continue listening to the client
-    if (!curReq->continues) {
-      close(curReq->socket);
-      connectionsOpen--;
-    }
-    free(curReq);
-  } else {
-    //not done sending, put the Request back in the Queue
-    eventQueue.push(curReq);
-  }
+size_t formatETag(char *buf, time_t mtime, off_t size, int weak)
+{
+  //the same mtime-size tag other servers use, so it survives a move between them
+  return sprintf(buf, "%s\"%lx-%llx\"", weak ? "W/" : "", (unsigned long)mtime, (unsigned long long)size);
 }
 
-int respondToHEAD(struct Request *curReq)
+size_t formatValidators(char *buf, size_t cap, time_t mtime, off_t size, int weak)
 {
-  // just sends the header for the requested response
-  std::cout << "Processing a request for HEAD\n";
-  std::string header = getHeader(curReq, "200 OK");
+  char etag[64];
+  formatETag(etag, mtime, size, weak);
+  struct tm tstruct;
+  gmtime_r(&mtime, &tstruct);
+  char date[64];
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tstruct);
+  int len = snprintf(buf, cap, "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n", etag, date);
+  return (len < (int)cap) ? len : cap - 1;
+}
 
-  send(curReq->socket, header.c_str(), header.length(), 0);
+time_t parseHttpDate(const char *date, size_t len)
+{
+  char copy[64];
+  if (len >= sizeof(copy)) return -1;
+  memcpy(copy, date, len);
+  copy[len] = '\0';
+  struct tm tstruct;
+  memset(&tstruct, 0, sizeof(tstruct));
+  const char *end = strptime(copy, "%a, %d %b %Y %H:%M:%S GMT", &tstruct);
+  if ((end == NULL) || (*end != '\0')) return -1;
+  return timegm(&tstruct);
+}
 
-  if (!curReq->continues) {
-    close(curReq->socket);
-    connectionsOpen--;
-    free(curReq);
+int isNotModified(struct Request *curReq)
+{
+  struct Slice header;
+  const char *buf = curReq->conn->inbuf.data;
+  //If-None-Match wins over If-Modified-Since, and it compares tags weakly
+  if (findHeader(&curReq->parser, buf, "If-None-Match", &header)) {
+    char etag[64];
+    size_t etaglen = formatETag(etag, curReq->mtime, curReq->fullsize, 0);
+    const char *p = buf + header.start;
+    const char *end = p + header.len;
+    while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+      const char *tag = p;
+      while (p < end && *p != ',') p++;
+      const char *tagEnd = p;
+      while (tagEnd > tag && (tagEnd[-1] == ' ' || tagEnd[-1] == '\t')) tagEnd--;
+      if ((tagEnd - tag == 1) && (*tag == '*')) return 1;
+      if ((tagEnd - tag > 2) && (tag[0] == 'W') && (tag[1] == '/')) tag += 2;
+      if (((size_t)(tagEnd - tag) == etaglen) && (memcmp(tag, etag, etaglen) == 0)) return 1;
+    }
+    return 0;
+  }
+  if (findHeader(&curReq->parser, buf, "If-Modified-Since", &header)) {
+    time_t since = parseHttpDate(buf + header.start, header.len);
+    return (since != -1) && (curReq->mtime <= since);
   }
+  return 0;
 }
 
-int respondToOPTIONS(struct Request *curReq)
+int selectRange(struct Request *curReq)
 {
-  std::cout << "Responding to OPTIONS\n";
-  std::string body = std::string("")
-    +"Access-Control-Allow-Methods: GET,HEAD,OPTIONS\n"
-    +"Allow: GET,HEAD,OPTIONS\n"
-    +"Public: GET,HEAD,OPTIONS\n";
-  curReq->filesize = body.length();
-  std::string response = getHeader(curReq, "200 OK");
-  //adds a simple body for the browser to display
-  response += body;
-  send(curReq->socket, response.c_str(), response.length(), 0);
-  
-  if (!curReq->continues) {
-    close(curReq->socket);
-    connectionsOpen--;
-    free(curReq);
+  struct Slice header;
+  const char *buf = curReq->conn->inbuf.data;
+  if (!findHeader(&curReq->parser, buf, "Range", &header)) {
+    return 0;
+  }
+  //If-Range asks for the range only if the file is still the one it names, strongly compared
+  struct Slice ifRange;
+  if (findHeader(&curReq->parser, buf, "If-Range", &ifRange)) {
+    char etag[64];
+    size_t etaglen = formatETag(etag, curReq->mtime, curReq->fullsize, 0);
+    int same = ((ifRange.len == etaglen) && (memcmp(buf + ifRange.start, etag, etaglen) == 0))
+      || (parseHttpDate(buf + ifRange.start, ifRange.len) == curReq->mtime);
+    if (!same) return 0;
+  }
+  const char *p = buf + header.start;
+  const char *end = p + header.len;
+  //only a single range is served, a list of them gets the whole file like any range we cannot read
+  if ((header.len < 6) || (strncasecmp(p, "bytes=", 6) != 0) || (memchr(p, ',', header.len) != NULL)) {
+    return 0;
   }
+  p += 6;
+  off_t first = -1, last = -1;
+  int digits = 0;
+  for (; p < end && isdigit((unsigned char)*p) && digits < 18; p++, digits++) {
+    first = ((first == -1) ? 0 : first * 10) + (*p - '0');
+  }
+  if (p >= end || *p != '-') return 0;
+  digits = 0;
+  for (p++; p < end && isdigit((unsigned char)*p) && digits < 18; p++, digits++) {
+    last = ((last == -1) ? 0 : last * 10) + (*p - '0');
+  }
+  if (p != end) return 0;
+  off_t size = curReq->fullsize;
+  if (first == -1) {
+    //bytes=-n is the last n bytes
+    if (last == -1) return 0;
+    if (last == 0) return -1;
+    first = (last < size) ? size - last : 0;
+    last = size - 1;
+  } else {
+    if ((last != -1) && (last < first)) return 0;
+    if ((last == -1) || (last >= size)) last = size - 1;
+  }
+  if (first >= size) {
+    return -1;
+  }
+  curReq->filepos = first;
+  curReq->filesize = last + 1;
+  curReq->status = 206;
+  return 1;
 }
 
-int respondWithError(struct Request *curReq, std::string error)
+//decodes the path of the URI, leaving out its query, and refuses anything that cannot name a file
+int uriToPath(const std::string &uri, std::string *path)
 {
-  // sends the error passed in
-  std::cout << "Responding with an error\n";
-  std::string errorbody = "<html>\n" + error + "\n</html>\n";
-  curReq->filesize = errorbody.length();
-  std::string response = getHeader(curReq, error);
-  //adds a simple body for the browser to display
-  response += errorbody;
-  send(curReq->socket, response.c_str(), response.length(), 0);
-  if (!curReq->continues) {
-    close(curReq->socket);
-    connectionsOpen--;
+  path->clear();
+  size_t end = uri.find('?');
+  if (end == std::string::npos) end = uri.length();
+  for (size_t i = 0; i < end; i++) {
+    char c = uri[i];
+    if (c == '%') {
+      if ((i + 2 >= end) || !isxdigit((unsigned char)uri[i + 1]) || !isxdigit((unsigned char)uri[i + 2])) {
+	return -1;
+      }
+      c = (char)strtol(uri.substr(i + 1, 2).c_str(), NULL, 16);
+      i += 2;
+    }
+    if (c == '\0') {
+      return -1;
+    }
+    //the root is the starting point, so leading slashes are dropped
+    if ((c == '/') && path->empty()) continue;
+    path->push_back(c);
   }
-  free(curReq);
+  if (path->empty()) {
+    path->assign(".");
+  }
+  return 0;
 }
 
-std::string getHeader(struct Request *curReq, std::string status)
+//walks the path one component at a time, for kernels without openat2, refusing .. and every symlink
+static int walkBeneath(const char *path, int flags)
 {
-  std::string statusline = curReq->version + std::string(" ") + status + "\n";
-  std::string serverline = "Server: Creation of Aaron M. Taylor and Devin P. Gardella for cs339 at Williams College\n";
-  std::string dateline = std::string("Date: ") + currentDateTime() + " GMT\n";
-  std::string contenttypeline = std::string("Content-type: ") + contentTypeForFile(curReq->requestURI);
-  std::stringstream lenstr; // these lines are necessary to convert from an int to a string
-  lenstr << curReq->filesize;
-  std::string contentlengthline;
-  if (strToUpper(curReq->method).compare("OPTIONS") != 0){
-    contentlengthline = std::string("Content-Length: ") + lenstr.str() + std::string("\n");
+  int dir = rootFd;
+  const char *part = path;
+  while (true) {
+    const char *slash = strchr(part, '/');
+    std::string name = slash ? std::string(part, slash - part) : std::string(part);
+    if (name == "..") {
+      if (dir != rootFd) close(dir);
+      errno = EXDEV;
+      return -1;
+    }
+    if (slash == NULL) {
+      int file = openat(dir, name.c_str(), flags | O_NOFOLLOW | O_CLOEXEC);
+      int saved = errno;
+      if (dir != rootFd) close(dir);
+      errno = saved;
+      return file;
+    }
+    if (!name.empty() && name != ".") {
+      int next = openat(dir, name.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      int saved = errno;
+      if (dir != rootFd) close(dir);
+      if (next == -1) {
+	errno = saved;
+	return -1;
+      }
+      dir = next;
+    }
+    part = slash + 1;
   }
-  //if the method is options, we have to return a body length of zero 
-  else {
-    contentlengthline = std::string("Content-Length: ") + std::string("0\n");
+}
+
+int openBeneath(const char *path, int flags)
+{
+  static std::atomic<int> noOpenat2(0);
+  if (!noOpenat2.load(std::memory_order_relaxed)) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int file = syscall(__NR_openat2, rootFd, path, &how, sizeof(how));
+    if ((file != -1) || (errno != ENOSYS)) {
+      return file;
+    }
+    noOpenat2.store(1, std::memory_order_relaxed);
   }
-  // other headers that we want to support can be added here as well
+  return walkBeneath(path, flags);
+}
 
-  std::string complete =   statusline
-			 + serverline
-			 + dateline
-                         + contentlengthline + "\n";
-  std::cout << complete;
-  return complete;
+const char *resolveStatus(int status)
+{
+  switch (status) {
+  case 400: return "400 Bad Request";
+  case 403: return "403 Forbidden";
+  default: return "404 Not Found";
+  }
 }
 
-int doesListenMore(Request *curReq)
+int PathCache::resolve(const std::string &path, struct stat *s, int *file)
 {
-  int version = atoi(curReq->version.substr(7,1).c_str());
-  if (version == 1) {
-    std::cout << "-> Should continue to listen on this socket\n";
-    return 1;
-  } else {
-    shutdown(curReq->socket,SHUT_RD);
-    std::cout << "XX Socket is being closed\n";
-    return 0;
+  if (file != NULL) *file = -1;
+  time_t now = time(0);
+  std::unordered_map<std::string, PathEntry>::iterator found = entries.find(path);
+  if ((found != entries.end()) && (found->second.expires > now)) {
+    *s = found->second.s;
+    return found->second.status;
   }
+  int status = lookupPath(path, s, file);
+  remember(path, status, (status == 200) ? s : NULL);
+  return status;
+}
+
+int PathCache::fresh(const std::string &path)
+{
+  std::unordered_map<std::string, PathEntry>::iterator found = entries.find(path);
+  return (found != entries.end()) && (found->second.expires > time(0));
 }
 
-std::string contentTypeForFile(std::string filename)
-{
-  //finds the position right after the '.' character and finds the length to the end of the string
-  int pos = filename.find(".") + 1;
-  int len = filename.length() - pos;
-  std::string extstr = filename.substr(pos,len);
-  //allows for case insensitive compare
-  extstr = strToUpper(extstr);
-  //handles various cases of official content types
-  //add more cases to handle more types
-  if (extstr.compare("HTML") == 0) {
-    return std::string("text/html");
-  } else if (extstr.compare("TXT") == 0) {
-    return std::string("text/plain");
-  } else if ((extstr.compare("JPG") == 0) || (extstr.compare("JPEG") == 0)) {
-    return std::string("image/jpeg");
-  } else if ((extstr.compare("PNG") == 0)) {
-    return std::string("image/png");
-  } else if (extstr.compare("GIF") == 0) {
-    return std::string("image/gif");
-  } else if (extstr.compare("M4R") == 0) {
-    return std::string("audio/m4r");
+int lookupPath(const std::string &path, struct stat *s, int *file)
+{
+  if (file != NULL) *file = -1;
+  //a descriptor only for the stat needs no read access, one the caller keeps must not block on a fifo
+  int opened = openBeneath(path.c_str(), (file != NULL) ? (O_RDONLY | O_NONBLOCK) : O_PATH);
+  if (opened == -1) {
+    //leaving the root, however it was attempted, is forbidden, anything else means there is no file
+    int status = ((errno == EXDEV) || (errno == ELOOP) || (errno == EACCES) || (errno == EPERM)) ? 403 : 404;
+    logMessage(LOG_DEBUG, "%s resolved to %d: %s", path.c_str(), status, strerror(errno));
+    return status;
+  }
+  int status = 200;
+  if (fstat(opened, s) == -1) {
+    status = 404;
+  } else if (!S_ISREG(s->st_mode) || !(S_IROTH & s->st_mode)) {
+    // request does not correspond to a regular file with universal read permissions
+    logMessage(LOG_DEBUG, "403 Forbidden%s", S_ISREG(s->st_mode) ? " (regular file)" : "");
+    status = 403;
+  }
+  if ((status == 200) && (file != NULL) && (fcntl(opened, F_SETFL, 0) == 0)) {
+    *file = opened;
   } else {
-    return std::string("");
+    close(opened);
   }
+  return status;
 }
 
-//Returns the appropriate amount of time before the timeout would occur.
-int getTimeout(){
-  //The larger the event queue, the smaller the timeout? 
-  int timeout = (3*TIMEOUT)/4 + (TIMEOUT/4)*( (100 - connectionsOpen) / 100 );
-    std::cout << "timeout for connectionsOpen: "<< connectionsOpen <<" is: "<< timeout <<"\n";
-    return timeout;
+int PathCache::open(const std::string &path, struct stat *s)
+{
+  int file = openBeneath(path.c_str(), O_RDONLY | O_NONBLOCK);
+  if ((file != -1) && (fstat(file, s) == 0) && S_ISREG(s->st_mode) && (fcntl(file, F_SETFL, 0) == 0)) {
+    return file;
+  }
+  //what was cached no longer holds, so the next request resolves the path afresh
+  if (file != -1) close(file);
+  forget(path);
+  return -1;
 }
 
-int fileLength(std::ifstream &file)
+void PathCache::remember(const std::string &path, int status, const struct stat *s)
 {
-   if (file.is_open()) {
-     file.seekg(0, std::ifstream::end);
-     
-     int end = file.tellg();
-     file.seekg(0, std::ios::beg);
-     return end;
-   } else {
-     std::cout << "file must be open to determine size\n";
-     return -1;
+  time_t now = time(0);
+  if ((entries.size() >= capacity) && (entries.find(path) == entries.end())) {
+    //expired entries make room first, and if a flood of distinct URIs left none, everything goes
+    for (std::unordered_map<std::string, PathEntry>::iterator it = entries.begin(); it != entries.end(); ) {
+      if (it->second.expires <= now) it = entries.erase(it);
+      else ++it;
+    }
+    if (entries.size() >= capacity) entries.clear();
   }
+  PathEntry &entry = entries[path];
+  entry.status = status;
+  if (s != NULL) entry.s = *s;
+  entry.expires = now + ((status == 200) ? PATH_TTL : MISSING_TTL);
 }
 
-// copied in from: http://stackoverflow.com/questions/997946/
-const std::string currentDateTime()
+//characters allowed in a method or header name
+static int isTokenChar(char c)
 {
-  time_t     now = time(0);
-  struct tm  tstruct;
-  char       buf[80];
-  tstruct = *localtime(&now);
-  strftime(buf, sizeof(buf), "%d %b %Y %X", &tstruct);
-  return buf;
+  return isalnum((unsigned char)c) || (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != NULL);
 }
 
-//this method ensures that the URI is valid
-std::string URIGuard(std::string handle)
+//walks the buffer one byte at a time from where the previous call stopped
+int parseRequest(struct RequestParser *p, const char *buf, size_t len)
 {
-  std::string fullpath = rootDirectory + handle;
-  //tests for higher directory access
-  if(handle.find("..",0,2) != std::string::npos){
-    std::cout << "found a \"..\" in " << handle << "\n";
-    return "403 Forbidden";
-  }
-  struct stat s;
-  if ( stat((char *) fullpath.c_str(), &s) == 0 ) {
-    if (S_ISREG(s.st_mode) && (S_IROTH & s.st_mode) ) {
-      // file is a regular file with universal read permissions
-    } else {
-      // request does not correspond to a regular file
-      std::cout << "403 Forbidden\n";
-      if (S_ISREG(s.st_mode)) std::cout << "IS REG";
-      return "403 Forbidden";
+  while (p->pos < len) {
+    char c = buf[p->pos];
+    switch (p->state) {
+    case P_METHOD:
+      if (isTokenChar(c)) {
+	// still inside the method
+      } else if (p->pos == p->mark && (c == ' ' || c == '\r' || c == '\n')) {
+	// blank lines and spaces ahead of the request line are skipped
+	p->mark++;
+      } else if (c == ' ') {
+	p->method.start = p->mark;
+	p->method.len = p->pos - p->mark;
+	p->mark = p->pos + 1;
+	p->state = P_URI;
+      } else {
+	p->state = P_ERROR;
+      }
+      break;
+    case P_URI:
+      if (c == ' ' && p->pos == p->mark) {
+	p->mark++;
+      } else if (c == ' ') {
+	p->uri.start = p->mark;
+	p->uri.len = p->pos - p->mark;
+	p->mark = p->pos + 1;
+	p->state = P_VERSION;
+      } else if ((unsigned char)c <= ' ' || c == 0x7f) {
+	// control characters, and HTTP/0.9 requests without a version, are refused
+	p->state = P_ERROR;
+      } else if (p->pos == p->mark && c != '/' && c != '*') {
+	p->state = P_ERROR;
+      }
+      break;
+    case P_VERSION:
+      if (c == ' ' && p->pos == p->mark) {
+	p->mark++;
+      } else if (c == ' ' || c == '\r' || c == '\n') {
+	p->version.start = p->mark;
+	p->version.len = p->pos - p->mark;
+	// the version has to be spelled HTTP/<digit>.<digit>, which ones are spoken is up to the worker
+	const char *v = buf + p->version.start;
+	if ((p->version.len != 8) || (memcmp(v, "HTTP/", 5) != 0) || !isdigit((unsigned char)v[5])
+	    || (v[6] != '.') || !isdigit((unsigned char)v[7])) {
+	  p->state = P_ERROR;
+	} else {
+	  p->state = (c == ' ') ? P_TRAIL : (c == '\r') ? P_LF : P_LINE;
+	}
+      }
+      break;
+    case P_TRAIL:
+      if (c == '\r') p->state = P_LF;
+      else if (c == '\n') p->state = P_LINE;
+      else if (c != ' ') p->state = P_ERROR;
+      break;
+    case P_LF:
+      p->state = (c == '\n') ? P_LINE : P_ERROR;
+      break;
+    case P_LINE:
+      if (c == '\r') {
+	p->state = P_FINAL_LF;
+      } else if (c == '\n') {
+	p->state = P_DONE;
+      } else if (isTokenChar(c)) {
+	p->mark = p->pos;
+	p->state = P_NAME;
+      } else {
+	// this includes obsolete folded header lines
+	p->state = P_ERROR;
+      }
+      break;
+    case P_NAME:
+      if (c == ':') {
+	if (p->headers < MAX_HEADERS) {
+	  p->names[p->headers].start = p->mark;
+	  p->names[p->headers].len = p->pos - p->mark;
+	}
+	p->state = P_VALUE_START;
+      } else if (!isTokenChar(c)) {
+	p->state = P_ERROR;
+      }
+      break;
+    case P_VALUE_START:
+      if (c == ' ' || c == '\t') {
+	break;
+      }
+      p->mark = p->pos;
+      p->valueEnd = p->pos;
+      p->state = P_VALUE;
+      // falls through so the first byte of the value is handled below
+    case P_VALUE:
+      if (c == '\r' || c == '\n') {
+	// headers beyond MAX_HEADERS are checked for syntax but not remembered
+	if (p->headers < MAX_HEADERS) {
+	  p->values[p->headers].start = p->mark;
+	  p->values[p->headers].len = p->valueEnd - p->mark;
+	  p->headers++;
+	} else {
+	  p->dropped++;
+	}
+	p->state = (c == '\r') ? P_LF : P_LINE;
+      } else if (c != ' ' && c != '\t') {
+	p->valueEnd = p->pos + 1;
+      }
+      break;
+    case P_FINAL_LF:
+      p->state = (c == '\n') ? P_DONE : P_ERROR;
+      break;
     }
-  } else {
-    // file does not exist
-    std::cout << "404 Not Found\n";
-    return "404 Not Found";
-  }
-  return "200 OK";
-}
-
-//uses regex's to test whether the expression is valid
-int regexGuard(std::string reqstr) 
-{  
-  //creates an uppercase guard of reqstr for testing the method
-  char tmpbuf[reqstr.length()];
-  reqstr.copy(tmpbuf,reqstr.length(),0);
-  std::string tmpstr = std::string(tmpbuf);
-  tmpstr = strToUpper(tmpstr);
-  std::regex methodGuard = std::regex("( )*((G|g)(E|e)(T|t)|(H|h)(E|e)(A|a)(D|d))( )+(.*)");
-  //std::regex methodGuard = std::regex("(GET|HEAD|OPTIONS)( )+(.*)", std::regex_constants::icase);
-
-  if (std::regex_match (reqstr,methodGuard)) {
-    std::cout << "reqstr has a valid method\n";
-    //guard for the rest of the request
-    std::regex guard = std::regex("(.*)( )+/(.*)( )+((H|h)(T|t)(T|t)(P|p))/1\\.(.*)");
-    if (std::regex_match (reqstr,guard)) {
-      return 1;
-    } else {
-      //Here we know that the method called was Get or Head, but it failed the HTTP part 
-      // and/or the file part...
+    if (p->state == P_ERROR) {
+      return PARSE_ERROR;
     }
-    return 0;
-  } else {
-    //This suggest it is a method we do not know about as it was not Get or Head...
-    std::regex options = std::regex("( )*(O|o)(P|p)(T|t)(I|i)(O|o)(N|n)(S|s)( )+(.*)");
-    if (std::regex_match (reqstr,options)){
-      std::cout << "Was an option";
-      return 1;
+    p->pos++;
+    if (p->state == P_DONE) {
+      return PARSE_DONE;
     }
   }
-  return 0;
+  return PARSE_INCOMPLETE;
 }
 
-// string parsing utility methods
-std::string strToUpper(std::string given)
+int sliceEquals(const char *buf, struct Slice slice, const char *str)
 {
-  char* cstr = (char *)given.c_str();
-  for ( int p = 0; p < given.length(); p++) {
-    cstr[p] = toupper(cstr[p]);
-  }
-  return std::string(cstr);
+  return (strlen(str) == slice.len) && (strncasecmp(buf + slice.start, str, slice.len) == 0);
 }
 
+//a body is only skipped when exactly one length is given for it, a chunked one or a header that was
+//not remembered could hide where the next request starts
+int bodyLength(struct RequestParser *parser, const char *buf, unsigned long long *len)
+{
+  *len = 0;
+  if (parser->dropped) {
+    return 0;
+  }
+  int seen = 0;
+  for (int i = 0; i < parser->headers; i++) {
+    if (sliceEquals(buf, parser->names[i], "Transfer-Encoding")) {
+      return 0;
+    }
+    if (sliceEquals(buf, parser->names[i], "Content-Length")) {
+      struct Slice value = parser->values[i];
+      if ((value.len == 0) || (value.len > 18)) return 0;
+      unsigned long long n = 0;
+      for (size_t j = value.start; j < value.start + value.len; j++) {
+	if (!isdigit((unsigned char)buf[j])) return 0;
+	n = n * 10 + (buf[j] - '0');
+      }
+      if (seen && (n != *len)) return 0;
+      *len = n;
+      seen = 1;
+    }
+  }
+  return 1;
+}
 
+int findHeader(struct RequestParser *parser, const char *buf, const char *name, struct Slice *value)
+{
+  for (int i = 0; i < parser->headers; i++) {
+    if (sliceEquals(buf, parser->names[i], name)) {
+      *value = parser->values[i];
+      return 1;
+    }
+  }
+  return 0;
+}